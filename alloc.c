@@ -34,6 +34,10 @@
  * $TheBOFH: slaballoc/alloc.c,v 1.8 2004/12/24 09:09:45 corecode Exp $
  */
 
+#if !defined(_KERNEL) && defined(__linux__) && !defined(_GNU_SOURCE)
+#define	_GNU_SOURCE		/* sched_getcpu() */
+#endif
+
 #include <sys/param.h>
 #include <sys/queue.h>
 
@@ -49,20 +53,76 @@
 
 
 #ifndef _KERNEL
-#include <sys/mman.h>
-
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #define	M_WAITOK	0
 #define	PAGESIZ		4096
-#define	NCPU		1
+#define	CACHE_LINE_SIZE	64
+
+#ifndef ALIGNBYTES
+#define	ALIGNBYTES	(sizeof(long) - 1)
+#endif
+#ifndef ALIGN
+#define	ALIGN(p)	(((unsigned long)(p) + ALIGNBYTES) & ~ALIGNBYTES)
+#endif
+
+#ifndef __aligned
+#define	__aligned(x)	__attribute__((__aligned__(x)))
+#endif
+
+#define	kmem_get_pages(arena, count, flags)		\
+	vmem_alloc((arena), (count), 0)
+#define	kmem_get_aligned_pages(arena, count, flags)	\
+	vmem_alloc((arena), (count), VM_ALIGNED)
+#define	kmem_return_pages(arena, addr, count)		\
+	vmem_free((arena), (addr), (count))
+
+typedef pthread_mutex_t	kmem_lock_t;
+
+#define	kmem_lock_init(lock)	pthread_mutex_init((lock), NULL)
+#define	kmem_lock_destroy(lock)	pthread_mutex_destroy(lock)
+#define	kmem_lock(lock)		pthread_mutex_lock(lock)
+#define	kmem_trylock(lock)	(pthread_mutex_trylock(lock) == 0)
+#define	kmem_unlock(lock)	pthread_mutex_unlock(lock)
+
+/*
+ * glibc implements sched_getcpu() on top of rseq where the kernel
+ * supports it, so this is a plain load in the common case.  Test
+ * programs can put threads on simulated CPUs, see kmem_thread_setcpu().
+ */
+static __thread int kmem_simcpu __attribute__((tls_model("initial-exec"))) = -1;
+
+static __inline int
+kmem_getcpu(void)
+{
+	if (kmem_simcpu >= 0)
+		return kmem_simcpu;
+#ifdef __linux__
+	return sched_getcpu();
+#else
+	return 0;
+#endif
+}
+#define	kmem_getncpu()		sysconf(_SC_NPROCESSORS_ONLN)
+
+/* Monotonic time in milliseconds */
+static __inline unsigned long
+kmem_gettime(void)
+{
+	struct timespec ts;
 
-#define	kmem_get_pages(count, flags)		\
-	mmap(NULL, (count) * PAGESIZ, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0)
-#define	kmem_return_pages(addr, count)		\
-	munmap((addr), (count) * PAGESIZ)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
 
 #define	KKASSERT(cond) do {			\
 	if (!(cond)) {				\
@@ -75,51 +135,300 @@
 
 
 #include "alloc.h"
+#include "vmem.h"
 
-#define	KH_NUM		64
+#define	KH_MINSIZE	64		/* Initial hash table size */
 #define	KM_MAXROUNDS	64
 #define	KM_MINROUNDS	16
+#define	KS_MAXPAGES	64		/* Largest naturally aligned slab */
+#define	KMEM_MAXNODES	8		/* NUMA nodes supported */
+#define	KMEM_MAXCPU	1024		/* CPUs in the node map */
+
+/*
+ * kmem_alloc() size classes are looked up in a table with an entry
+ * for every 1 << KMEM_ALIGN_SHIFT bytes, up to KMEM_MAXBUF.
+ */
+#define	KMEM_ALIGN_SHIFT	3
+
+/*
+ * Slabs are kept on lists by occupancy: all bufs free, KS_NPARTIAL
+ * buckets of partially used slabs from emptiest to fullest, and no
+ * free bufs left.  Allocations come from the fullest partial slab,
+ * so lightly used slabs get a chance to drain and be reaped.
+ */
+#define	KS_NPARTIAL	8
+#define	KS_FREE		0
+#define	KS_USED		(KS_NPARTIAL + 1)
+#define	KS_NLISTS	(KS_NPARTIAL + 2)
+
+/*
+ * Magazine resizing: at most once per KM_UPDATE_INTERVAL ms, a cache
+ * moves to the next larger magazine type if its depot was contended
+ * more than KM_RESIZE_CONTENTION times, or if more than one in
+ * KM_RESIZE_MISSRATIO of at least KM_RESIZE_MINALLOCS allocations
+ * missed the magazine layer.
+ */
+#define	KM_UPDATE_INTERVAL	1000
+#define	KM_RESIZE_CONTENTION	16
+#define	KM_RESIZE_MISSRATIO	8
+#define	KM_RESIZE_MINALLOCS	1024
+
+/*
+ * kmem_cache_reap() does nothing if the cache was reaped less than
+ * KM_REAP_INTERVAL ms ago, so that reaping doesn't thrash against
+ * allocations.
+ */
+#define	KM_REAP_INTERVAL	1000
+
+/* Magazines kmem_reclaim() drains before checking its target */
+#define	KM_RECLAIM_BATCH	16
+
+/* Cache flags */
+#define	KMC_NOREAP	0x0001		/* Never give slabs back */
+#define	KMC_HASH	0x0002		/* External slab data, hashed bufctls */
+#define	KMC_HUGEPAGE	0x0004		/* Slabs from the huge page arenas */
+#define	KMC_COLORRANDOM	0x0008		/* Random slab colors */
+#define	KMC_MAGAZINE	0x0010		/* Holds magazines itself */
+#define	KMC_BITMAP	0x0020		/* Free map instead of freelists */
+
+/* Bits per word of a slab's free map */
+#define	KS_MAPBITS	(sizeof(unsigned long) * NBBY)
+
+/*
+ * Static tracepoints where allocs and frees move between layers, for
+ * dtrace, or bpftrace and systemtap, through <sys/sdt.h>.  Unless
+ * KMEM_TRACE is defined they compile to nothing.
+ */
+#ifdef KMEM_TRACE
+#include <sys/sdt.h>
+#define	KMEM_PROBE1(name, a)		DTRACE_PROBE1(kmem, name, a)
+#define	KMEM_PROBE2(name, a, b)		DTRACE_PROBE2(kmem, name, a, b)
+#define	KMEM_PROBE3(name, a, b, c)	DTRACE_PROBE3(kmem, name, a, b, c)
+#else
+#define	KMEM_PROBE1(name, a)
+#define	KMEM_PROBE2(name, a, b)
+#define	KMEM_PROBE3(name, a, b, c)
+#endif
+
+/*
+ * With KMEM_LATENCY, one in KMEM_LAT_SAMPLE allocs and frees of each
+ * thread is timed.  The time goes into the histogram of the deepest
+ * layer the operation reached, see kmem_cache_getlatency().  Without
+ * it, the macros compile to nothing.
+ */
+#ifdef KMEM_LATENCY
+#ifndef KMEM_LAT_SAMPLE
+#define	KMEM_LAT_SAMPLE		64
+#endif
+#define	KMEM_LAT_DECL		uint64_t kmem_lat_t0; int kmem_lat_path
+#define	KMEM_LAT_BEGIN(path)	\
+	(kmem_lat_t0 = kmem_lat_begin(), kmem_lat_path = (path))
+#define	KMEM_LAT_PATH(path)	\
+	(kmem_lat_path = MAX(kmem_lat_path, (path)))
+#define	KMEM_LAT_END(cpu) do {						\
+	if (kmem_lat_t0 != 0)						\
+		kmem_lat_end((cpu), kmem_lat_path, kmem_lat_t0);	\
+} while (0)
+#else
+#define	KMEM_LAT_DECL
+#define	KMEM_LAT_BEGIN(path)
+#define	KMEM_LAT_PATH(path)
+#define	KMEM_LAT_END(cpu)
+#endif
+
+/*
+ * With KMEM_RECORD, allocs and frees of traced caches are appended
+ * to the trace while one is being recorded.  Records are buffered and
+ * written under one lock, which serializes the traced operations, but
+ * it also makes the order of the trace a valid order to replay them
+ * in: allocs are recorded before they return, frees before they
+ * happen.
+ */
+#ifdef KMEM_RECORD
+#define	KMEM_REC_BUFSIZE	4096		/* Records per write */
+#define	KMEM_RECORD_OP(op, cp, obj) do {				\
+	if (kmem_recording && (cp)->kc_recid != 0)			\
+		kmem_record((op), (cp), (obj));				\
+} while (0)
+#define	KMEM_RECORD_BULK(op, cp, n, objs) do {				\
+	size_t kmem_rec_i;						\
+									\
+	if (kmem_recording && (cp)->kc_recid != 0)			\
+		for (kmem_rec_i = 0; kmem_rec_i < (n); kmem_rec_i++)	\
+			kmem_record((op), (cp), (objs)[kmem_rec_i]);	\
+} while (0)
+#else
+#define	KMEM_RECORD_OP(op, cp, obj)
+#define	KMEM_RECORD_BULK(op, cp, n, objs)
+#endif
+
+/*
+ * The lock-free depot needs a double-width compare-and-swap.
+ * Define KMEM_LOCKED_DEPOT to use the locked depot regardless.
+ */
+#if !defined(KMEM_LOCKED_DEPOT) && defined(__LP64__) && \
+    defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+#define	KMEM_LOCKFREE_DEPOT
+#endif
 
 struct kmem_bufctl;
 struct kmem_magazine;
+
+struct kmem_magtype {
+	int		mt_rounds;		/* Rounds per magazine */
+	const char	*mt_name;		/* Name of magazine cache */
+	struct kmem_cache *mt_cache;		/* Magazine cache */
+};
 typedef SLIST_HEAD(, kmem_bufctl) kmem_hashentry;
-typedef kmem_hashentry	kmem_hashtab[KH_NUM];
+
+/*
+ * Locking: the per-CPU magazines are protected by kcc_lock, which
+ * is uncontended unless a thread migrates between picking its CPU
+ * and taking the lock.  The depots are either lock-free or protected
+ * by their kd_lock, and the slab layer by kn_slablock, so only magazine
+ * misses pay for shared synchronization.  Locks are taken in that order.
+ *
+ * The loaded and previous magazines only hold bufs of the CPU's own
+ * node.  Bufs of other nodes are collected in the alien magazines,
+ * which go to their node's depot once they are full.
+ */
+/*
+ * Counters of one CPU, only updated with its CPU lock held.
+ * kmem_cache_getstats() reads them without the lock, which is fine
+ * for counters that only grow, as long as 64-bit loads don't tear.
+ */
+struct kmem_cpu_stats {
+	uint64_t	kcs_allocs;		/* Total allocs */
+	uint64_t	kcs_frees;		/* Frees into magazines */
+	uint64_t	kcs_magmiss;		/* Magazine misses */
+	uint64_t	kcs_refills;		/* Magazines filled from slabs */
+	uint64_t	kcs_remotefree;		/* Frees of other nodes' bufs */
+	uint64_t	kcs_depotfull;		/* Full magazines from the depot */
+	uint64_t	kcs_depotempty;		/* Empty magazines from the depot */
+	uint64_t	kcs_depotcontention;	/* Contended depot accesses */
+};
+
+#ifdef KMEM_LATENCY
+/*
+ * Sampled latencies of one CPU.  The samples are added after the CPU
+ * lock was dropped, and maybe by a thread that moved on to another
+ * CPU in the meantime, so they are added atomically.
+ */
+struct kmem_cpu_latency {
+	uint64_t	kcl_ticks[KMEM_LAT_NPATHS];	/* Sum of samples */
+	uint64_t	kcl_hist[KMEM_LAT_NPATHS][KMEM_LAT_NBUCKETS];
+};
+#endif
 
 struct kmem_cpu_cache {
+	kmem_lock_t	kcc_lock;		/* Protects this CPU's data */
 	int		kcc_rounds;		/* Rounds in loaded magazine */
 	struct kmem_magazine *kcc_loaded;	/* Loaded magazine */
 	int		kcc_prevrounds;		/* Rounds in previous magazine */
 	struct kmem_magazine *kcc_previous;	/* Previous magazine */
 	int		kcc_magsize;		/* Rounds per magazine */
-	struct kmem_cache_stats kcc_stats;	/* Statistics */
-	char		kcc_pad;		/* XXX Pad to cache line */
+	int		kcc_node;		/* NUMA node of this CPU */
+	struct kmem_magazine *kcc_alien[KMEM_MAXNODES];	/* Remote frees */
+	struct kmem_cpu_stats kcc_stats;	/* Statistics */
+#ifdef KMEM_LATENCY
+	struct kmem_cpu_latency kcc_lat;	/* Sampled latencies */
+#endif
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * The lock-free depot is a stack whose top pointer carries a
+ * generation count.  Both are swapped at once, so a magazine that
+ * was popped and pushed back in the meantime can't be mistaken for
+ * an unchanged top (ABA).  Magazine memory is never given back to
+ * the page layer, so a stale top can always be dereferenced.
+ */
+#ifdef KMEM_LOCKFREE_DEPOT
+union kmem_depot_top {
+	struct {
+		struct kmem_magazine *kdt_mag;	/* Top of stack */
+		unsigned long	kdt_gen;	/* Generation count */
+	};
+	unsigned __int128 kdt_word;		/* For the CAS */
+};
+#endif
+
+struct kmem_depot {
+#ifdef KMEM_LOCKFREE_DEPOT
+	volatile union kmem_depot_top kd_top __aligned(16);	/* Magazine stack */
+#else
+	kmem_lock_t	kd_lock;		/* Protects this depot */
+	SLIST_HEAD(, kmem_magazine) kd_mags;	/* Magazine stack */
+#endif
+	unsigned int	kd_count;		/* Magazines in depot */
+	unsigned int	kd_min;			/* Minimum count this interval */
+	unsigned int	kd_reaplimit;		/* Minimum of last interval */
 };
 
+/*
+ * The slab layer and depots of a cache on one NUMA node.  Its slabs
+ * only hold memory of that node.
+ */
+struct kmem_node {
+	kmem_lock_t	kn_slablock;		/* Protects slab layer */
+	TAILQ_HEAD(kmem_slab_list, kmem_slab) kn_slabs[KS_NLISTS]; /* By occupancy */
+	unsigned int	kn_partialmap;		/* Non-empty partial lists */
+	struct kmem_depot kn_fulldepot;		/* Full magazines depot */
+	struct kmem_depot kn_emptydepot;	/* Empty magazines depot */
+	struct vmem	*kn_arena;		/* Source of slab pages */
+	unsigned int	kn_color;		/* Coloring of next slab */
+	unsigned int	kn_colorseed;		/* State of random coloring */
+	kmem_hashentry	*kn_hashtab;		/* Bufctl hash table */
+	unsigned long	kn_hashmask;		/* Hash table size - 1 */
+	unsigned long	kn_hashcount;		/* Bufctls in hash table */
+
+	/* Statistics, under the slab lock unless noted */
+	uint64_t	kn_slaballocs;		/* Bufs taken from slabs */
+	uint64_t	kn_slabfrees;		/* Bufs returned to slabs */
+	uint64_t	kn_directfrees;		/* Frees bypassing the magazines */
+	uint64_t	kn_slabcreates;		/* Slabs created */
+	uint64_t	kn_slabdestroys;	/* Slabs freed, atomic */
+	uint64_t	kn_pages;		/* Pages held by slabs, atomic */
+	uint64_t	kn_maxpages;		/* High-water mark of kn_pages */
+	uint64_t	kn_maxbufs;		/* High-water mark of bufs taken */
+} __aligned(CACHE_LINE_SIZE);
+
 struct kmem_cache {
-	TAILQ_HEAD(, kmem_slab) kc_slabs;	/* Slabs: empty to full */
-	struct kmem_slab *kc_freeslab;		/* First slab w/ bufs */
-	SLIST_HEAD(, kmem_magazine) kc_fulldepot;	/* Full magazines depot */
-	SLIST_HEAD(, kmem_magazine) kc_emptydepot;	/* Empty magazines depot */
+	TAILQ_ENTRY(kmem_cache) kc_entry;	/* List of all caches */
 	const char	*kc_name;		/* Informational name */
 	size_t		kc_size;		/* Size of objects */
 	size_t		kc_realsize;		/* Size incl. alignment */
 	unsigned int	kc_align;		/* Needed alignment */
 	kmem_cache_cdtor *kc_ctor;		/* Constructor of objects */
 	kmem_cache_cdtor *kc_dtor;		/* Destructor of objects */
-	unsigned int	kc_color;		/* Coloring of next slab */
+	kmem_cache_slabctor *kc_slabctor;	/* Constructor of whole slabs */
+	int		kc_flags;		/* KMC_* flags */
 	unsigned int	kc_maxcolor;		/* Maximum color allowed */
+	unsigned int	kc_colorstep;		/* Distance between colors */
 	unsigned int	kc_pages;		/* Pages per slab */
 	unsigned int	kc_bufs;		/* Buffers per slab */
-	kmem_hashtab	*kc_hashtab;		/* Bufctl hash table */
-	char		kc_pad;			/* XXX Pad to cache line */
-	struct kmem_cpu_cache kc_cpu[NCPU];	/* Per-CPU data */
+	size_t		kc_slabhdr;		/* Size of inline slab header */
+	int		kc_hashshift;		/* Buf address bits to skip */
+	struct kmem_magtype *kc_magtype;	/* Current magazine type */
+	unsigned long	kc_magupdate;		/* Time of last resize check */
+	struct kmem_cache_stats kc_magstats;	/* Stats at last resize check */
+	unsigned long	kc_reaptime;		/* Time of last reap */
+#ifdef KMEM_RECORD
+	uint32_t	kc_recid;		/* Trace ID, 0 if not traced */
+#endif
+	struct kmem_node *kc_nodes;		/* Per-node data, behind kc_cpu */
+	struct kmem_cpu_cache kc_cpu[];		/* Per-CPU data, kmem_ncpu */
 };
 
 struct kmem_slab {
 	TAILQ_ENTRY(kmem_slab) ks_entry;	/* Slab linkage */
 	SLIST_HEAD(, kmem_bufctl) ks_freebufs;	/* List of free bufs */
 	unsigned int	ks_refcnt;		/* Used buf count */
+	unsigned int	ks_list;		/* Index into kn_slabs */
+	unsigned int	ks_carved;		/* Bufs handed out from ks_base on */
+	unsigned int	ks_maphint;		/* No free bufs in words below */
 	void		*ks_page;		/* Base of the page(s) used */
+	char		*ks_base;		/* First buf */
+	unsigned long	ks_freemap[];		/* KMC_BITMAP: set bits are free */
 };
 
 struct kmem_bufctl {
@@ -134,71 +443,540 @@ struct kmem_bufctl_inline {
 
 struct kmem_magazine {
 	SLIST_ENTRY(kmem_magazine) km_entry;	/* Next magazine */
+	struct kmem_magtype *km_type;		/* Type of this magazine */
 	unsigned int	km_rounds;		/* Bufs available */
-	struct kmem_bufctl *km_round[KM_MAXROUNDS];	/* Array of bufs */
+	struct kmem_bufctl *km_round[];		/* Array of bufs */
 };
 
 
-static void kmem_cache_init(struct kmem_cache *, const char *, size_t,
-		unsigned int, kmem_cache_cdtor *, kmem_cache_cdtor *);
-static unsigned int kmem_bufaddr_makehash(void *);
-static struct kmem_slab *kmem_alloc_slab(struct kmem_cache *, int);
-static void kmem_empty_magazine(struct kmem_cache *, struct kmem_magazine *);
-static void kmem_returnto_slab(struct kmem_cache *, void *);
+static struct kmem_cache *kmem_cache_bootstrap(const char *, size_t,
+		unsigned int);
+static int kmem_cache_init(struct kmem_cache *, const char *, size_t,
+		unsigned int, kmem_cache_cdtor *, kmem_cache_cdtor *,
+		const struct kmem_cache_attr *);
+static void kmem_init_topology(void);
+static void kmem_alloc_init(void);
+static int kmem_hugearena_create(void);
+static kmem_hashentry *kmem_bufaddr_makehash(struct kmem_cache *,
+		struct kmem_node *, void *);
+static kmem_hashentry *kmem_hash_alloc(unsigned long);
+static void kmem_hash_free(kmem_hashentry *, unsigned long);
+static void kmem_hash_rescale(struct kmem_cache *, struct kmem_node *,
+		unsigned long);
+static void kmem_depot_init(struct kmem_depot *);
+static void kmem_depot_destroy(struct kmem_depot *);
+static struct kmem_magazine *kmem_depot_get(struct kmem_depot *,
+		struct kmem_cpu_cache *);
+static void kmem_depot_put(struct kmem_depot *, struct kmem_magazine *,
+		struct kmem_cpu_cache *);
+static void kmem_depot_ws_reap(struct kmem_cache *, struct kmem_node *,
+		struct kmem_depot *);
+static void kmem_depot_drain(struct kmem_cache *, struct kmem_node *,
+		struct kmem_depot *);
+static unsigned int kmem_cache_reap_slabs(struct kmem_cache *);
+static void kmem_free_slab(struct kmem_cache *, struct kmem_node *,
+		struct kmem_slab *);
+static void kmem_cache_forklock(struct kmem_cache *);
+static void kmem_cache_forkunlock(struct kmem_cache *, int);
+static void *kmem_maint_thread(void *);
+static void kmem_maint_writedump(void);
+static void kmem_cache_dump(FILE *, struct kmem_cache *, int, int);
+static void kmem_dump_name(FILE *, const char *, int);
+#ifdef KMEM_RECORD
+static void kmem_record(int, struct kmem_cache *, void *);
+static void kmem_record_flush(void);
+static void kmem_record_child(void);
+static void kmem_record_atfork(void);
+#endif
+static struct kmem_slab *kmem_alloc_slab(struct kmem_cache *,
+		struct kmem_node *, int);
+static void kmem_slab_requeue(struct kmem_cache *, struct kmem_node *,
+		struct kmem_slab *);
+static unsigned int kmem_slab_color(struct kmem_cache *, struct kmem_node *);
+static void kmem_construct_slab(struct kmem_cache *, struct kmem_slab *);
+static size_t kmem_alloc_from_slab(struct kmem_cache *, struct kmem_node *,
+		int, size_t, void **);
+static void kmem_cache_magazine_update(struct kmem_cache *);
+static void kmem_cache_magazine_purge(struct kmem_cache *);
+static void kmem_empty_magazine(struct kmem_cache *, struct kmem_node *,
+		struct kmem_magazine *);
+static void kmem_magazine_destroy(struct kmem_cache *, struct kmem_node *,
+		struct kmem_magazine *);
+static void kmem_returnto_slab(struct kmem_cache *, struct kmem_node *,
+		void *);
+static struct kmem_slab *kmem_buf_slab(struct kmem_cache *,
+		struct kmem_node *, void *, struct kmem_bufctl **);
+static void kmem_slab_putbuf(struct kmem_cache *, struct kmem_slab *,
+		void *, struct kmem_bufctl *);
+static size_t kmem_bitmap_alloc(struct kmem_cache *, struct kmem_slab *,
+		size_t, void **);
+static void kmem_cache_free_remote(struct kmem_cache *, int, void *);
+static void *kmem_cache_alloc_refill(struct kmem_cache *, struct kmem_node *,
+		int);
+
+
+#define	KMEM_CACHE_SIZE	\
+	(sizeof(struct kmem_cache) + kmem_ncpu * sizeof(struct kmem_cpu_cache) + \
+	 kmem_nnodes * sizeof(struct kmem_node))
+
+static int kmem_ncpu;
+static int kmem_nnodes;
+static unsigned char kmem_cpunode[KMEM_MAXCPU];	/* Node of each CPU */
+
+static kmem_lock_t kmem_cachelock;		/* Protects kmem_caches */
+static TAILQ_HEAD(kmem_cache_list, kmem_cache) kmem_caches; /* All caches */
+
+static pthread_t kmem_maint_tid;
+static pthread_mutex_t kmem_maint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kmem_maint_cv = PTHREAD_COND_INITIALIZER;
+static unsigned int kmem_maint_interval;	/* 0 if not running */
+static const char *kmem_maint_dumppath;		/* Dump written each interval */
+static int kmem_maint_dumpformat;		/* KMEM_DUMP_* */
+
+#ifdef KMEM_RECORD
+static kmem_lock_t kmem_rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int kmem_recording;		/* Trace being recorded */
+static int kmem_rec_fd = -1;			/* Under kmem_rec_lock */
+static unsigned long kmem_rec_start;		/* Start time, ns */
+static uint32_t kmem_rec_nextid;		/* Last cache ID handed out */
+static uint32_t kmem_rec_nthreads;		/* Last thread ID handed out */
+static unsigned int kmem_rec_count;		/* Records in kmem_rec_buf */
+static struct kmem_record kmem_rec_buf[KMEM_REC_BUFSIZE];
+static __thread uint32_t kmem_rec_thread
+    __attribute__((tls_model("initial-exec")));
+#endif
 
+/* Page arenas per node.  The node 0 arenas also go by their own names. */
+static struct vmem *kmem_arenas[KMEM_MAXNODES];
+static struct vmem *kmem_hugearenas[KMEM_MAXNODES];	/* Created on demand */
+struct vmem *kmem_arena;			/* Node 0, also for metadata */
+struct vmem *kmem_hugearena;			/* Node 0 huge pages */
 
-static struct kmem_cache cache_cch;
+static struct kmem_cache *cache_cch;
 static struct kmem_cache *slab_cch;
 static struct kmem_cache *bufctl_cch;
 static struct kmem_cache *hashtab_cch;
-static struct kmem_cache *mag_cch;
+
+/*
+ * Use naturally aligned multi-page slabs with inline administrative
+ * data where the waste allows.  Read when a cache is created.
+ */
+int kmem_slab_aligned = 1;
+
+/*
+ * kmem_alloc() size classes.  They are spaced at most 1/8 apart above
+ * 128 bytes, so rounding up wastes little.
+ */
+static const unsigned int kmem_alloc_sizes[] = {
+	8, 16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+	10240, 12288, 14336, KMEM_MAXBUF
+};
+#define	KMEM_NALLOCSIZES	(sizeof(kmem_alloc_sizes) / sizeof(kmem_alloc_sizes[0]))
+
+static char kmem_alloc_names[KMEM_NALLOCSIZES][sizeof("kmem_alloc_16384")];
+static struct kmem_cache *kmem_alloc_table[KMEM_MAXBUF >> KMEM_ALIGN_SHIFT];
+
+/*
+ * Magazine types, smallest first.  Each has its own cache, so small
+ * magazines don't waste the space of the large ones.
+ */
+static struct kmem_magtype kmem_magtypes[] = {
+	{ KM_MINROUNDS,	"kmem_magazine_16" },
+	{ 24,		"kmem_magazine_24" },
+	{ 32,		"kmem_magazine_32" },
+	{ 48,		"kmem_magazine_48" },
+	{ KM_MAXROUNDS,	"kmem_magazine_64" },
+};
+#define	KM_NMAGTYPES	(sizeof(kmem_magtypes) / sizeof(kmem_magtypes[0]))
+
+/*
+ * Return the per-CPU cache of the CPU we are running on.  CPU ids
+ * above the online count (sparse hotplug) are folded back in.
+ */
+static __inline struct kmem_cpu_cache *
+kmem_cpu_cache(struct kmem_cache *cp)
+{
+	int cpu;
+
+	cpu = kmem_getcpu();
+	if ((unsigned)cpu >= (unsigned)kmem_ncpu)
+		cpu = (unsigned)cpu % kmem_ncpu;
+
+	return &cp->kc_cpu[cpu];
+}
+
+/*
+ * Return the NUMA node of the CPU we are running on.
+ */
+static __inline int
+kmem_curnode(void)
+{
+	int cpu;
+
+	cpu = kmem_getcpu();
+	if ((unsigned)cpu >= (unsigned)kmem_ncpu)
+		cpu = (unsigned)cpu % kmem_ncpu;
+
+	return kmem_cpunode[cpu];
+}
+
+#ifdef KMEM_LATENCY
+static __thread unsigned int kmem_lat_ops
+    __attribute__((tls_model("initial-exec")));
+
+/*
+ * Latency ticks: the TSC where there is one, else nanoseconds.
+ */
+static __inline uint64_t
+kmem_lat_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Returns the start time if this operation is sampled, else 0.
+ */
+static __inline uint64_t
+kmem_lat_begin(void)
+{
+	uint64_t t0;
+
+	if (++kmem_lat_ops % KMEM_LAT_SAMPLE != 0)
+		return 0;
+	t0 = kmem_lat_ticks();
+	return t0 != 0 ? t0 : 1;
+}
+
+static void
+kmem_lat_end(struct kmem_cpu_cache *cpu, int path, uint64_t t0)
+{
+	uint64_t ticks;
+	int bucket;
+
+	ticks = kmem_lat_ticks() - t0;
+	if ((int64_t)ticks < 0)		/* TSCs of CPUs out of sync */
+		ticks = 0;
+	bucket = ticks == 0 ? 0 : 63 - __builtin_clzll(ticks);
+	if (bucket >= KMEM_LAT_NBUCKETS)
+		bucket = KMEM_LAT_NBUCKETS - 1;
+	__atomic_fetch_add(&cpu->kcc_lat.kcl_hist[path][bucket], 1,
+	    __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cpu->kcc_lat.kcl_ticks[path], ticks,
+	    __ATOMIC_RELAXED);
+}
+#endif
 
 void
 kmem_init(void)
 {
-	/* Bootstrap cache cache */
-	kmem_cache_init(&cache_cch, "kmem_cache", sizeof(struct kmem_cache), 0, NULL, NULL);
+	unsigned int i;
+
+	if (kmem_ncpu != 0)
+		return;
+
+	kmem_init_topology();
+
+	kmem_lock_init(&kmem_cachelock);
+	TAILQ_INIT(&kmem_caches);
+
+	/* With a single node there is nothing to bind the arena to */
+	for (i = 0; i < kmem_nnodes; i++) {
+		kmem_arenas[i] = vmem_create("kmem_arena", 0,
+		    kmem_nnodes > 1 ? (int)i : -1);
+		if (kmem_arenas[i] == NULL)
+			err(1, "kmem_init");
+	}
+	kmem_arena = kmem_arenas[0];
+
+	/*
+	 * The size of struct kmem_cache depends on the number of CPUs,
+	 * so it might need multi-page slabs.  Bootstrap the caches
+	 * those need first, directly from the page layer.
+	 */
+	slab_cch = kmem_cache_bootstrap("kmem_slab", sizeof(struct kmem_slab), 0);
+	bufctl_cch = kmem_cache_bootstrap("kmem_bufctl", sizeof(struct kmem_bufctl), 0);
+	hashtab_cch = kmem_cache_bootstrap("kmem_hashtab",
+	    KH_MINSIZE * sizeof(kmem_hashentry), 0);
+	for (i = 0; i < KM_NMAGTYPES; i++) {
+		struct kmem_magtype *mt;
+
+		mt = &kmem_magtypes[i];
+		mt->mt_cache = kmem_cache_bootstrap(mt->mt_name,
+		    sizeof(struct kmem_magazine) +
+		    mt->mt_rounds * sizeof(struct kmem_bufctl *), 0);
+		mt->mt_cache->kc_flags |= KMC_MAGAZINE;
+#ifdef KMEM_LOCKFREE_DEPOT
+		/* The lock-free depot relies on magazines staying mapped */
+		mt->mt_cache->kc_flags |= KMC_NOREAP;
+#endif
+	}
+	cache_cch = kmem_cache_bootstrap("kmem_cache", KMEM_CACHE_SIZE, CACHE_LINE_SIZE);
+
+	kmem_alloc_init();
+}
+
+/*
+ * Create the kmem_alloc() caches and point every table entry at the
+ * smallest one that fits.  Power of two sizes are naturally aligned,
+ * others to the largest power of two that divides them.
+ */
+static void
+kmem_alloc_init(void)
+{
+	struct kmem_cache *cp;
+	unsigned int i, size, idx;
+
+	idx = 0;
+	for (i = 0; i < KMEM_NALLOCSIZES; i++) {
+		size = kmem_alloc_sizes[i];
+		snprintf(kmem_alloc_names[i], sizeof(kmem_alloc_names[i]),
+		    "kmem_alloc_%u", size);
+		cp = kmem_cache_create(kmem_alloc_names[i], size,
+		    MIN(size & -size, PAGESIZ), NULL, NULL);
+		if (cp == NULL)
+			err(1, "kmem_init");
+
+		for (; idx < size >> KMEM_ALIGN_SHIFT; idx++)
+			kmem_alloc_table[idx] = cp;
+	}
+}
+
+/*
+ * Find the NUMA node of every CPU.  KMEM_NODEMAP overrides the system
+ * topology with a comma separated list of the node of each CPU, so a
+ * multi-node layout can be simulated on any machine; the list is
+ * repeated if there are more CPUs than entries, and there are at least
+ * as many CPUs as entries.  Runs before anything can be allocated, so
+ * it sticks to plain system calls.
+ */
+static void
+kmem_init_topology(void)
+{
+	char buf[512], *p;
+	const char *map;
+	int cpu, lo, hi, node, fd, len, n;
+
+	kmem_ncpu = kmem_getncpu();
+	if (kmem_ncpu < 1)
+		kmem_ncpu = 1;
+	if (kmem_ncpu > KMEM_MAXCPU)
+		kmem_ncpu = KMEM_MAXCPU;
+	kmem_nnodes = 1;
+
+	map = getenv("KMEM_NODEMAP");
+	if (map != NULL && *map != '\0') {
+		for (n = 0; *map != '\0' && n < KMEM_MAXCPU; n++) {
+			node = strtol(map, &p, 10);
+			if (p == map || node < 0 || node >= KMEM_MAXNODES)
+				errx(1, "KMEM_NODEMAP: bad node list");
+			kmem_cpunode[n] = node;
+			if (node >= kmem_nnodes)
+				kmem_nnodes = node + 1;
+			map = *p == ',' ? p + 1 : p;
+		}
+		if (kmem_ncpu < n)
+			kmem_ncpu = n;
+		for (cpu = n; cpu < kmem_ncpu; cpu++)
+			kmem_cpunode[cpu] = kmem_cpunode[cpu % n];
+		return;
+	}
+
+	for (node = 0; node < KMEM_MAXNODES; node++) {
+		snprintf(buf, sizeof(buf),
+		    "/sys/devices/system/node/node%d/cpulist", node);
+		if ((fd = open(buf, O_RDONLY)) < 0)
+			continue;
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len <= 0)
+			continue;
+		buf[len] = '\0';
+
+		/* A list of ranges like "0-3,8-11" */
+		for (p = buf; *p >= '0' && *p <= '9';) {
+			lo = hi = strtol(p, &p, 10);
+			if (*p == '-')
+				hi = strtol(p + 1, &p, 10);
+			for (cpu = lo; cpu <= hi && cpu < KMEM_MAXCPU; cpu++)
+				kmem_cpunode[cpu] = node;
+			if (*p == ',')
+				p++;
+		}
+		if (node >= kmem_nnodes)
+			kmem_nnodes = node + 1;
+	}
+}
+
+/*
+ * Run the calling thread as if it was on the given CPU, or on the one
+ * it is really running on if cpu is negative.  Together with
+ * KMEM_NODEMAP, this allows testing the NUMA paths on a single node.
+ */
+void
+kmem_thread_setcpu(int cpu)
+{
+	kmem_simcpu = cpu;
+}
+
+static struct kmem_cache *
+kmem_cache_bootstrap(const char *name, size_t size, unsigned int align)
+{
+	struct kmem_cache *cp;
 
-	/* Bootstrap remaining caches */
-	slab_cch = kmem_cache_create("kmem_slab", sizeof(struct kmem_slab), 0, NULL, NULL);
-	bufctl_cch = kmem_cache_create("kmem_bufctl", sizeof(struct kmem_slab), 0, NULL, NULL);
-	hashtab_cch = kmem_cache_create("kmem_hashtab", sizeof(kmem_hashtab), 0, NULL, NULL);
-	mag_cch = kmem_cache_create("kmem_magazine", sizeof(struct kmem_magazine), 0, NULL, NULL);
+	cp = kmem_get_pages(kmem_arena, howmany(KMEM_CACHE_SIZE, PAGESIZ), M_WAITOK);
+	if (cp == NULL)
+		err(1, "kmem_init");
+	if (kmem_cache_init(cp, name, size, align, NULL, NULL, NULL) != 0)
+		err(1, "kmem_init");
+
+	return cp;
 }
 
 struct kmem_cache *
 kmem_cache_create(const char *name, size_t size, unsigned int align,
 		kmem_cache_cdtor *ctor, kmem_cache_cdtor *dtor)
+{
+	return kmem_cache_create_attr(name, size, align, ctor, dtor, NULL);
+}
+
+void
+kmem_cache_attr_init(struct kmem_cache_attr *attr)
+{
+	attr->kca_flags = 0;
+	attr->kca_slabctor = NULL;
+	attr->kca_colorstep = 0;
+	attr->kca_maxcolor = 0;
+}
+
+struct kmem_cache *
+kmem_cache_create_attr(const char *name, size_t size, unsigned int align,
+		kmem_cache_cdtor *ctor, kmem_cache_cdtor *dtor,
+		const struct kmem_cache_attr *attr)
 {
 	struct kmem_cache *cp;
 
-	cp = kmem_cache_alloc(&cache_cch, M_WAITOK);
-	kmem_cache_init(cp, name, size, align, ctor, dtor);
+	/*
+	 * Only constructed bufs can be destructed: the others might
+	 * never have been handed out, or hold the free list linkage.
+	 */
+	if (dtor != NULL && ctor == NULL &&
+	    (attr == NULL || attr->kca_slabctor == NULL))
+		return NULL;
+
+	if (attr != NULL && (attr->kca_flags & KMCA_HUGEPAGE) &&
+	    kmem_hugearena_create() != 0)
+		return NULL;
+
+	cp = kmem_cache_alloc(cache_cch, M_WAITOK);
+	if (cp == NULL)
+		return NULL;
+	if (kmem_cache_init(cp, name, size, align, ctor, dtor, attr) != 0) {
+		kmem_cache_free(cache_cch, cp);
+		return NULL;
+	}
+#ifdef KMEM_RECORD
+	cp->kc_recid = __sync_add_and_fetch(&kmem_rec_nextid, 1);
+	KMEM_RECORD_OP(KMEM_REC_CREATE, cp, NULL);
+#endif
 
 	return cp;
 }
 
-static void
+/*
+ * The huge page arenas reserve a lot at once, so only create them
+ * once a cache asks for them.
+ */
+static int
+kmem_hugearena_create(void)
+{
+	int i, error;
+
+	error = 0;
+	kmem_lock(&kmem_cachelock);
+	for (i = 0; i < kmem_nnodes; i++) {
+		if (kmem_hugearenas[i] != NULL)
+			continue;
+		kmem_hugearenas[i] = vmem_create("kmem_hugearena", VMC_HUGEPAGE,
+		    kmem_nnodes > 1 ? i : -1);
+		if (kmem_hugearenas[i] == NULL) {
+			error = ENOMEM;
+			break;
+		}
+	}
+	kmem_hugearena = kmem_hugearenas[0];
+	kmem_unlock(&kmem_cachelock);
+
+	return error;
+}
+
+/*
+ * Whether a slab of the given number of pages, with the slab header
+ * inline, wastes at most 1/5 of its space.
+ */
+static __inline int
+kmem_slab_inline_fits(size_t realsize, unsigned int pages)
+{
+	size_t slabsize;
+
+	slabsize = pages * PAGESIZ;
+	return (slabsize - sizeof(struct kmem_slab)) / realsize * realsize >=
+	    slabsize * 4 / 5;
+}
+
+/*
+ * Returns 0, or ENOMEM if the hash tables can't be allocated.
+ */
+static int
 kmem_cache_init(struct kmem_cache *cp, const char *name, size_t size,
-		unsigned int align, kmem_cache_cdtor *ctor, kmem_cache_cdtor *dtor)
+		unsigned int align, kmem_cache_cdtor *ctor, kmem_cache_cdtor *dtor,
+		const struct kmem_cache_attr *attr)
 {
-	int i;
+	int i, j;
 
-	TAILQ_INIT(&cp->kc_slabs);
-	cp->kc_freeslab = NULL;
-	SLIST_INIT(&cp->kc_fulldepot);
-	SLIST_INIT(&cp->kc_emptydepot);
 	cp->kc_name = name;
 	cp->kc_size = size;
 	cp->kc_align = align;
 	cp->kc_ctor = ctor;
 	cp->kc_dtor = dtor;
-	cp->kc_color = 0;	/* randomize? */
+	cp->kc_slabctor = NULL;
+	cp->kc_flags = 0;
+	if (attr != NULL) {
+		if (attr->kca_flags & KMCA_HUGEPAGE)
+			cp->kc_flags |= KMC_HUGEPAGE;
+		if (attr->kca_flags & KMCA_COLORRANDOM)
+			cp->kc_flags |= KMC_COLORRANDOM;
+		if (attr->kca_flags & KMCA_BITMAP)
+			cp->kc_flags |= KMC_BITMAP;
+		cp->kc_slabctor = attr->kca_slabctor;
+	}
+	cp->kc_magtype = &kmem_magtypes[0];
+	cp->kc_magupdate = kmem_gettime();
+	memset(&cp->kc_magstats, 0, sizeof(cp->kc_magstats));
+	cp->kc_reaptime = cp->kc_magupdate;
 
 	if (cp->kc_align < ALIGN(1))
 		cp->kc_align = ALIGN(1);
 
-	cp->kc_realsize = (cp->kc_size + cp->kc_align - 1) /
+	/*
+	 * Free bufs of constructed caches keep their state, so the
+	 * inline linkage can't overlap the object.  A free map doesn't
+	 * link through the bufs at all.
+	 */
+	cp->kc_realsize = cp->kc_size;
+	if ((cp->kc_ctor != NULL || cp->kc_slabctor != NULL) &&
+	    !(cp->kc_flags & KMC_BITMAP))
+		cp->kc_realsize += sizeof(struct kmem_bufctl_inline);
+	cp->kc_realsize = (cp->kc_realsize + cp->kc_align - 1) /
 		cp->kc_align * cp->kc_align;
 
 	/* At the moment a no-op */
@@ -206,423 +984,2157 @@ kmem_cache_init(struct kmem_cache *cp, const char *name, size_t size,
 		cp->kc_realsize = sizeof(struct kmem_bufctl_inline);
 
 	/*
-	 * Only accept up to 1/5 waste. If it is more,
-	 * use external administrative information.
+	 * Only accept up to 1/5 waste.  If a page doesn't do, try
+	 * naturally aligned multi-page slabs, which still keep the
+	 * administrative information inline.  Failing that, use
+	 * external administrative information.
 	 */
-	if ((PAGESIZ - sizeof(struct kmem_slab)) / cp->kc_realsize * cp->kc_realsize
-	    < PAGESIZ * 4 / 5) {
-		int i;
+	cp->kc_pages = 1;
+	if (kmem_slab_aligned) {
+		while (!kmem_slab_inline_fits(cp->kc_realsize, cp->kc_pages) &&
+		    cp->kc_pages < KS_MAXPAGES)
+			cp->kc_pages *= 2;
+	}
 
+	cp->kc_slabhdr = sizeof(struct kmem_slab);
+	if (!kmem_slab_inline_fits(cp->kc_realsize, cp->kc_pages)) {
+		/* Bufs are found through the hash table, not a free map */
+		cp->kc_flags |= KMC_HASH;
+		cp->kc_flags &= ~KMC_BITMAP;
 		cp->kc_pages = 2;
 		while (cp->kc_pages * PAGESIZ / cp->kc_realsize * cp->kc_realsize
 		    < (PAGESIZ + sizeof(struct kmem_slab)) * cp->kc_pages * 4 / 5)
 			cp->kc_pages++;
 
-		cp->kc_hashtab = kmem_cache_alloc(hashtab_cch, M_WAITOK);
-		for (i = 0; i < KH_NUM; i++)
-			SLIST_INIT(&(*cp->kc_hashtab)[i]);
+		/*
+		 * Bufs are kc_realsize apart, so the address bits below
+		 * its highest bit hardly carry information.
+		 */
+		cp->kc_hashshift = 0;
+		while ((2UL << cp->kc_hashshift) <= cp->kc_realsize)
+			cp->kc_hashshift++;
 
 		cp->kc_bufs = cp->kc_pages * PAGESIZ / cp->kc_realsize;
 		cp->kc_maxcolor = cp->kc_pages * PAGESIZ - cp->kc_bufs * cp->kc_realsize;
 	} else {
-		cp->kc_pages = 1;
-		cp->kc_bufs = (PAGESIZ - sizeof(struct kmem_slab)) / cp->kc_realsize;
-		cp->kc_maxcolor = PAGESIZ - sizeof(struct kmem_slab) - cp->kc_bufs * cp->kc_realsize;
+		size_t slabsize;
+
+		slabsize = cp->kc_pages * PAGESIZ;
+		cp->kc_bufs = (slabsize - cp->kc_slabhdr) / cp->kc_realsize;
+		if (cp->kc_flags & KMC_BITMAP) {
+			/* The free map takes its space from the bufs */
+			for (;;) {
+				cp->kc_slabhdr = sizeof(struct kmem_slab) +
+				    howmany(cp->kc_bufs, KS_MAPBITS) *
+				    sizeof(unsigned long);
+				if (cp->kc_bufs * cp->kc_realsize + cp->kc_slabhdr <=
+				    slabsize)
+					break;
+				cp->kc_bufs--;
+			}
+		}
+		cp->kc_maxcolor = slabsize - cp->kc_slabhdr - cp->kc_bufs * cp->kc_realsize;
+	}
+
+	/*
+	 * Slabs start their bufs at different offsets out of the slack,
+	 * so bufs at the same index don't all compete for the same
+	 * cache sets.  Colors step by a cache line, and stay multiples
+	 * of the alignment.
+	 */
+	cp->kc_colorstep = CACHE_LINE_SIZE;
+	if (attr != NULL && attr->kca_colorstep != 0)
+		cp->kc_colorstep = attr->kca_colorstep;
+	cp->kc_colorstep = roundup(cp->kc_colorstep, cp->kc_align);
+	if (attr != NULL && attr->kca_maxcolor != 0)
+		cp->kc_maxcolor = MIN(cp->kc_maxcolor, attr->kca_maxcolor);
+	if (attr != NULL && (attr->kca_flags & KMCA_NOCOLOR))
+		cp->kc_maxcolor = 0;
+	cp->kc_maxcolor = cp->kc_maxcolor / cp->kc_colorstep * cp->kc_colorstep;
+
+	cp->kc_nodes = (struct kmem_node *)&cp->kc_cpu[kmem_ncpu];
+	for (i = 0; i < kmem_nnodes; ++i) {
+		struct kmem_node *kn;
+
+		kn = &cp->kc_nodes[i];
+		if (cp->kc_flags & KMC_HASH) {
+			kn->kn_hashtab = kmem_hash_alloc(KH_MINSIZE);
+			if (kn->kn_hashtab == NULL)
+				goto fail;
+			kn->kn_hashmask = KH_MINSIZE - 1;
+			kn->kn_hashcount = 0;
+		}
+		kmem_lock_init(&kn->kn_slablock);
+		for (j = 0; j < KS_NLISTS; ++j)
+			TAILQ_INIT(&kn->kn_slabs[j]);
+		kn->kn_partialmap = 0;
+		kmem_depot_init(&kn->kn_fulldepot);
+		kmem_depot_init(&kn->kn_emptydepot);
+		kn->kn_arena = cp->kc_flags & KMC_HUGEPAGE ?
+		    kmem_hugearenas[i] : kmem_arenas[i];
+		kn->kn_color = 0;
+		kn->kn_colorseed = 2654435761U * (i + 1);
+		kn->kn_slaballocs = kn->kn_slabfrees = kn->kn_directfrees = 0;
+		kn->kn_slabcreates = kn->kn_slabdestroys = 0;
+		kn->kn_pages = kn->kn_maxpages = 0;
+		kn->kn_maxbufs = 0;
 	}
 
-	for (i = 0; i < NCPU; ++i) {
+	for (i = 0; i < kmem_ncpu; ++i) {
 		struct kmem_cpu_cache *cpu;
 
 		cpu = &cp->kc_cpu[i];
+		kmem_lock_init(&cpu->kcc_lock);
 		cpu->kcc_rounds = cpu->kcc_prevrounds = -1;
 		cpu->kcc_loaded = cpu->kcc_previous = NULL;
-		cpu->kcc_magsize = KM_MINROUNDS;
-		cpu->kcc_stats.kcs_allocs = 0;
-		cpu->kcc_stats.kcs_misses = 0;
+		cpu->kcc_magsize = cp->kc_magtype->mt_rounds;
+		cpu->kcc_node = kmem_cpunode[i];
+		memset(cpu->kcc_alien, 0, sizeof(cpu->kcc_alien));
+		memset(&cpu->kcc_stats, 0, sizeof(cpu->kcc_stats));
+	}
+
+	kmem_lock(&kmem_cachelock);
+	TAILQ_INSERT_TAIL(&kmem_caches, cp, kc_entry);
+	kmem_unlock(&kmem_cachelock);
+
+	return 0;
+
+fail:
+	while (--i >= 0) {
+		struct kmem_node *kn;
+
+		kn = &cp->kc_nodes[i];
+		kmem_hash_free(kn->kn_hashtab, KH_MINSIZE);
+		kmem_depot_destroy(&kn->kn_fulldepot);
+		kmem_depot_destroy(&kn->kn_emptydepot);
+		kmem_lock_destroy(&kn->kn_slablock);
 	}
+
+	return ENOMEM;
 }
 
 void
 kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *slab;
-	struct kmem_magazine *mag;
 	int i;
 
-	while ((mag = SLIST_FIRST(&cp->kc_fulldepot)) != NULL) {
-		SLIST_REMOVE_HEAD(&cp->kc_fulldepot, km_entry);
-		kmem_empty_magazine(cp, mag);
-		kmem_cache_free(mag_cch, mag);
-	}
-
-	while ((mag = SLIST_FIRST(&cp->kc_emptydepot)) != NULL) {
-		SLIST_REMOVE_HEAD(&cp->kc_emptydepot, km_entry);
-		kmem_cache_free(mag_cch, mag);
-	}
-
-	for (i = 0; i < NCPU; ++i) {
-		struct kmem_cpu_cache *cpu;
-
-		cpu = &cp->kc_cpu[i];
-
-		if (cpu->kcc_loaded != NULL) {
-			cpu->kcc_loaded->km_rounds = cpu->kcc_rounds;
-			kmem_empty_magazine(cp, cpu->kcc_loaded);
-			kmem_cache_free(mag_cch, cpu->kcc_loaded);
-		}
-		if (cpu->kcc_previous != NULL) {
-			cpu->kcc_previous->km_rounds = cpu->kcc_prevrounds;
-			kmem_empty_magazine(cp, cpu->kcc_previous);
-			kmem_cache_free(mag_cch, cpu->kcc_previous);
-		}
-	}
+	KMEM_RECORD_OP(KMEM_REC_DESTROY, cp, NULL);
 
-	while ((slab = TAILQ_FIRST(&cp->kc_slabs)) != NULL) {
-		void *page;
+	kmem_lock(&kmem_cachelock);
+	TAILQ_REMOVE(&kmem_caches, cp, kc_entry);
+	kmem_unlock(&kmem_cachelock);
 
-		KKASSERT((slab->ks_refcnt == 0));
+	kmem_cache_magazine_purge(cp);
 
-		TAILQ_REMOVE(&cp->kc_slabs, slab, ks_entry);
-		page = slab->ks_page;
+	for (i = 0; i < kmem_ncpu; ++i)
+		kmem_lock_destroy(&cp->kc_cpu[i].kcc_lock);
 
-		if (cp->kc_pages > 1) {
-			struct kmem_bufctl *bufctl;
+	for (i = 0; i < kmem_nnodes; ++i) {
+		struct kmem_node *kn;
 
-			while ((bufctl = SLIST_FIRST(&slab->ks_freebufs)) != NULL) {
-				SLIST_REMOVE_HEAD(&slab->ks_freebufs, kb_entry);
-				kmem_cache_free(bufctl_cch, bufctl);
-			}
+		kn = &cp->kc_nodes[i];
+		KKASSERT((kn->kn_partialmap == 0));
+		KKASSERT((TAILQ_EMPTY(&kn->kn_slabs[KS_USED])));
+		while ((slab = TAILQ_FIRST(&kn->kn_slabs[KS_FREE])) != NULL) {
+			KKASSERT((slab->ks_refcnt == 0));
 
-			kmem_cache_free(slab_cch, slab);
+			TAILQ_REMOVE(&kn->kn_slabs[KS_FREE], slab, ks_entry);
+			kmem_free_slab(cp, kn, slab);
 		}
 
-		kmem_return_pages(page, cp->kc_pages);
-	}
-
-	if (cp->kc_pages > 1)
-		kmem_cache_free(hashtab_cch, cp->kc_hashtab);
+		if (cp->kc_flags & KMC_HASH)
+			kmem_hash_free(kn->kn_hashtab, kn->kn_hashmask + 1);
 
-	kmem_cache_free(&cache_cch, cp);
+		kmem_depot_destroy(&kn->kn_fulldepot);
+		kmem_depot_destroy(&kn->kn_emptydepot);
+		kmem_lock_destroy(&kn->kn_slablock);
+	}
+	kmem_cache_free(cache_cch, cp);
 }
 
+/*
+ * Give back memory the cache doesn't need: magazines that stayed
+ * unused in the depots over the last two reap intervals, and all
+ * slabs without allocated buffers.
+ */
 void
-kmem_cache_getstats(struct kmem_cache *cp, struct kmem_cache_stats *stats)
+kmem_cache_reap(struct kmem_cache *cp)
 {
+	struct kmem_node *kn;
+	unsigned long now, last, size;
 	int i;
 
-	KKASSERT((stats != NULL));
-
-	stats->kcs_allocs = stats->kcs_magmiss = stats->kcs_misses = 0;
-	for (i = 0; i < NCPU; ++i) {
-		struct kmem_cache_stats *cpustat;
+	now = kmem_gettime();
+	last = cp->kc_reaptime;
+	if (now - last < KM_REAP_INTERVAL ||
+	    !__sync_bool_compare_and_swap(&cp->kc_reaptime, last, now))
+		return;
 
-		cpustat = &cp->kc_cpu[i].kcc_stats;
-		stats->kcs_misses += cpustat->kcs_misses;
-		stats->kcs_magmiss += cpustat->kcs_magmiss;
-		stats->kcs_allocs += cpustat->kcs_allocs;
+	for (i = 0; i < kmem_nnodes; i++) {
+		kn = &cp->kc_nodes[i];
+		kmem_depot_ws_reap(cp, kn, &kn->kn_fulldepot);
+		kmem_depot_ws_reap(cp, kn, &kn->kn_emptydepot);
 	}
+	kmem_cache_reap_slabs(cp);
+
+	/* Shrink the hash tables if they got too sparse */
+	if (!(cp->kc_flags & KMC_HASH))
+		return;
+	for (i = 0; i < kmem_nnodes; i++) {
+		kn = &cp->kc_nodes[i];
+		kmem_lock(&kn->kn_slablock);
+		if (kn->kn_hashcount * 8 < kn->kn_hashmask + 1 &&
+		    kn->kn_hashmask + 1 > KH_MINSIZE) {
+			for (size = KH_MINSIZE; size < kn->kn_hashcount * 2;)
+				size *= 2;
+			kmem_hash_rescale(cp, kn, size);
+		}
+		kmem_unlock(&kn->kn_slablock);
+	}
+}
+
+/*
+ * Reclaim stages, cheapest first.  After each stage is applied to a
+ * cache, its free slabs are given back.
+ */
+enum {
+	KMEM_RECLAIM_SLABS,		/* Only free slabs */
+	KMEM_RECLAIM_DEPOTWS,		/* Magazines unused by the working set */
+	KMEM_RECLAIM_DEPOT,		/* All depot magazines */
+	KMEM_RECLAIM_CPU,		/* Per-CPU magazines, too */
+	KMEM_RECLAIM_NSTAGES
+};
+
+/*
+ * Give memory back to the page layer across all caches until at least
+ * target bytes are freed, or there is nothing left to free.  This
+ * ignores the reap rate limit, as it is meant for memory pressure.
+ * Allocations only contend on the CPU locks briefly in the last stage.
+ * Returns the number of bytes freed.
+ */
+size_t
+kmem_reclaim(size_t target)
+{
+	struct kmem_cache *cp;
+	struct kmem_magazine *mag;
+	struct kmem_node *kn;
+	size_t freed;
+	int stage, n, i;
+
+	freed = 0;
+	kmem_lock(&kmem_cachelock);
+	for (stage = 0; stage < KMEM_RECLAIM_NSTAGES; stage++) {
+		TAILQ_FOREACH(cp, &kmem_caches, kc_entry) {
+			if (freed >= target)
+				goto done;
+
+			switch (stage) {
+			case KMEM_RECLAIM_SLABS:
+				break;
+			case KMEM_RECLAIM_DEPOTWS:
+				for (i = 0; i < kmem_nnodes; i++) {
+					kn = &cp->kc_nodes[i];
+					kmem_depot_ws_reap(cp, kn, &kn->kn_fulldepot);
+					kmem_depot_ws_reap(cp, kn, &kn->kn_emptydepot);
+				}
+				break;
+			case KMEM_RECLAIM_DEPOT:
+				/*
+				 * Full magazines hold a lot of memory,
+				 * so check the target as we go.
+				 */
+				n = 0;
+				for (i = 0; i < kmem_nnodes; i++) {
+					kn = &cp->kc_nodes[i];
+					while (freed < target && (mag = kmem_depot_get(
+					    &kn->kn_fulldepot, NULL)) != NULL) {
+						kmem_magazine_destroy(cp, kn, mag);
+						if (++n % KM_RECLAIM_BATCH == 0)
+							freed += (size_t)
+							    kmem_cache_reap_slabs(cp) *
+							    PAGESIZ;
+					}
+					kmem_depot_drain(cp, kn, &kn->kn_emptydepot);
+				}
+				break;
+			case KMEM_RECLAIM_CPU:
+				kmem_cache_magazine_purge(cp);
+				break;
+			}
+
+			freed += (size_t)kmem_cache_reap_slabs(cp) * PAGESIZ;
+		}
+	}
+done:
+	kmem_unlock(&kmem_cachelock);
+
+	/* Slabs only go back to the arenas, push them on to the kernel */
+	for (i = 0; i < kmem_nnodes; i++) {
+		vmem_reap(kmem_arenas[i]);
+		if (kmem_hugearenas[i] != NULL)
+			vmem_reap(kmem_hugearenas[i]);
+	}
+
+	return freed;
+}
+
+/*
+ * Call func for every cache.  Caches can't be created or destroyed
+ * from within func.
+ */
+void
+kmem_cache_applyall(void (*func)(struct kmem_cache *, void *), void *arg)
+{
+	struct kmem_cache *cp;
+
+	kmem_lock(&kmem_cachelock);
+	TAILQ_FOREACH(cp, &kmem_caches, kc_entry)
+		func(cp, arg);
+	kmem_unlock(&kmem_cachelock);
+}
+
+/*
+ * Handlers for pthread_atfork(), for programs that allocate from
+ * several threads and fork.  kmem_fork_prepare() takes every lock of
+ * the allocator, so that the child finds no lock held by a thread it
+ * doesn't have.  Caches are locked newest first: the slab layer of
+ * any cache allocates from the bootstrap caches, which come first in
+ * the list, the slab and bufctl caches before all others.  The
+ * maintenance thread isn't there in the child.
+ */
+void
+kmem_fork_prepare(void)
+{
+	struct kmem_cache *cp;
+
+	pthread_mutex_lock(&kmem_maint_lock);
+	kmem_lock(&kmem_cachelock);
+	TAILQ_FOREACH_REVERSE(cp, &kmem_caches, kmem_cache_list, kc_entry)
+		kmem_cache_forklock(cp);
+	vmem_fork_prepare();
+}
+
+void
+kmem_fork_parent(void)
+{
+	struct kmem_cache *cp;
+
+	vmem_fork_parent();
+	TAILQ_FOREACH(cp, &kmem_caches, kc_entry)
+		kmem_cache_forkunlock(cp, 0);
+	kmem_unlock(&kmem_cachelock);
+	pthread_mutex_unlock(&kmem_maint_lock);
+}
+
+void
+kmem_fork_child(void)
+{
+	struct kmem_cache *cp;
+
+	vmem_fork_child();
+	TAILQ_FOREACH(cp, &kmem_caches, kc_entry)
+		kmem_cache_forkunlock(cp, 1);
+	kmem_lock_init(&kmem_cachelock);
+	kmem_maint_interval = 0;
+	pthread_mutex_init(&kmem_maint_lock, NULL);
+	pthread_cond_init(&kmem_maint_cv, NULL);
+}
+
+/*
+ * Lock order within a cache: the CPUs, then the depots, then the
+ * slab layer.
+ */
+static void
+kmem_cache_forklock(struct kmem_cache *cp)
+{
+	struct kmem_node *kn;
+	int i;
+
+	for (i = 0; i < kmem_ncpu; ++i)
+		kmem_lock(&cp->kc_cpu[i].kcc_lock);
+	for (i = 0; i < kmem_nnodes; ++i) {
+		kn = &cp->kc_nodes[i];
+#ifndef KMEM_LOCKFREE_DEPOT
+		kmem_lock(&kn->kn_fulldepot.kd_lock);
+		kmem_lock(&kn->kn_emptydepot.kd_lock);
+#endif
+		kmem_lock(&kn->kn_slablock);
+	}
+}
+
+/*
+ * In the child, the locks are set up again instead.
+ */
+static void
+kmem_cache_forkunlock(struct kmem_cache *cp, int child)
+{
+	struct kmem_node *kn;
+	int i;
+
+	for (i = 0; i < kmem_nnodes; ++i) {
+		kn = &cp->kc_nodes[i];
+		if (child) {
+			kmem_lock_init(&kn->kn_slablock);
+#ifndef KMEM_LOCKFREE_DEPOT
+			kmem_lock_init(&kn->kn_fulldepot.kd_lock);
+			kmem_lock_init(&kn->kn_emptydepot.kd_lock);
+#endif
+			continue;
+		}
+		kmem_unlock(&kn->kn_slablock);
+#ifndef KMEM_LOCKFREE_DEPOT
+		kmem_unlock(&kn->kn_fulldepot.kd_lock);
+		kmem_unlock(&kn->kn_emptydepot.kd_lock);
+#endif
+	}
+	for (i = 0; i < kmem_ncpu; ++i) {
+		if (child)
+			kmem_lock_init(&cp->kc_cpu[i].kcc_lock);
+		else
+			kmem_unlock(&cp->kc_cpu[i].kcc_lock);
+	}
+}
+
+const char *
+kmem_cache_name(struct kmem_cache *cp)
+{
+	return cp->kc_name;
+}
+
+size_t
+kmem_cache_bufsize(struct kmem_cache *cp)
+{
+	return cp->kc_size;
+}
+
+/*
+ * Return the cache buf was allocated from, or NULL if it isn't from
+ * a slab.  This takes no locks.
+ */
+struct kmem_cache *
+kmem_cache_lookup(void *buf)
+{
+	return vmem_owner(buf);
+}
+
+/*
+ * Start a thread that reaps all caches and checks their magazine
+ * size every msec milliseconds.
+ */
+int
+kmem_maint_start(unsigned int msec)
+{
+	int error;
+
+	if (msec == 0)
+		return EINVAL;
+
+	pthread_mutex_lock(&kmem_maint_lock);
+	if (kmem_maint_interval != 0) {
+		kmem_maint_interval = msec;
+		pthread_mutex_unlock(&kmem_maint_lock);
+		return 0;
+	}
+	kmem_maint_interval = msec;
+	error = pthread_create(&kmem_maint_tid, NULL, kmem_maint_thread, NULL);
+	if (error != 0)
+		kmem_maint_interval = 0;
+	pthread_mutex_unlock(&kmem_maint_lock);
+
+	return error;
+}
+
+void
+kmem_maint_stop(void)
+{
+	pthread_mutex_lock(&kmem_maint_lock);
+	if (kmem_maint_interval == 0) {
+		pthread_mutex_unlock(&kmem_maint_lock);
+		return;
+	}
+	kmem_maint_interval = 0;
+	pthread_cond_signal(&kmem_maint_cv);
+	pthread_mutex_unlock(&kmem_maint_lock);
+
+	pthread_join(kmem_maint_tid, NULL);
+}
+
+/*
+ * Have the maintenance thread write a kmem_dump() to path after every
+ * interval, or stop doing so if path is NULL.  The dump is written
+ * next to it and renamed over it, so readers never see a partial
+ * one.  path has to stay valid while it is set.
+ */
+void
+kmem_maint_dump(const char *path, int format)
+{
+	pthread_mutex_lock(&kmem_maint_lock);
+	kmem_maint_dumppath = path;
+	kmem_maint_dumpformat = format;
+	pthread_mutex_unlock(&kmem_maint_lock);
+}
+
+/*
+ * Called with kmem_maint_lock held.
+ */
+static void
+kmem_maint_writedump(void)
+{
+	char tmppath[MAXPATHLEN];
+	FILE *fp;
+	int error;
+
+	if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", kmem_maint_dumppath) >=
+	    (int)sizeof(tmppath))
+		return;
+	fp = fopen(tmppath, "w");
+	if (fp == NULL)
+		return;
+	error = kmem_dump(fp, kmem_maint_dumpformat);
+	if (fclose(fp) != 0 || error != 0 ||
+	    rename(tmppath, kmem_maint_dumppath) != 0)
+		unlink(tmppath);
+}
+
+static void *
+kmem_maint_thread(void *arg)
+{
+	struct kmem_cache *cp;
+	struct timespec ts;
+
+	pthread_mutex_lock(&kmem_maint_lock);
+	while (kmem_maint_interval != 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += kmem_maint_interval / 1000;
+		ts.tv_nsec += (kmem_maint_interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&kmem_maint_cv, &kmem_maint_lock, &ts);
+		if (kmem_maint_interval == 0)
+			break;
+		pthread_mutex_unlock(&kmem_maint_lock);
+
+		kmem_lock(&kmem_cachelock);
+		TAILQ_FOREACH(cp, &kmem_caches, kc_entry) {
+			kmem_cache_magazine_update(cp);
+			kmem_cache_reap(cp);
+		}
+		kmem_unlock(&kmem_cachelock);
+
+		pthread_mutex_lock(&kmem_maint_lock);
+		if (kmem_maint_dumppath != NULL)
+			kmem_maint_writedump();
+	}
+	pthread_mutex_unlock(&kmem_maint_lock);
+
+	return NULL;
+}
+
+void
+kmem_cache_getstats(struct kmem_cache *cp, struct kmem_cache_stats *stats)
+{
+	int i;
+
+	KKASSERT((stats != NULL));
+
+	/*
+	 * No locks are taken: the counters live on the lines of their
+	 * CPU or node, and the sums are only a snapshot anyway.
+	 */
+	memset(stats, 0, sizeof(*stats));
+	stats->kcs_version = KMEM_STATS_VERSION;
+	stats->kcs_bufsize = cp->kc_size;
+	for (i = 0; i < kmem_ncpu; ++i) {
+		struct kmem_cpu_stats *cpustat;
+
+		cpustat = &cp->kc_cpu[i].kcc_stats;
+		stats->kcs_allocs += cpustat->kcs_allocs;
+		stats->kcs_frees += cpustat->kcs_frees;
+		stats->kcs_magmiss += cpustat->kcs_magmiss;
+		stats->kcs_refills += cpustat->kcs_refills;
+		stats->kcs_remotefree += cpustat->kcs_remotefree;
+		stats->kcs_depotfull += cpustat->kcs_depotfull;
+		stats->kcs_depotempty += cpustat->kcs_depotempty;
+		stats->kcs_depotcontention += cpustat->kcs_depotcontention;
+	}
+	for (i = 0; i < kmem_nnodes; ++i) {
+		struct kmem_node *kn;
+
+		kn = &cp->kc_nodes[i];
+		stats->kcs_frees += kn->kn_directfrees;
+		stats->kcs_misses += kn->kn_slaballocs;
+		stats->kcs_slabfrees += kn->kn_slabfrees;
+		stats->kcs_slabcreates += kn->kn_slabcreates;
+		stats->kcs_slabdestroys += kn->kn_slabdestroys;
+		stats->kcs_pages += kn->kn_pages;
+		stats->kcs_maxpages += kn->kn_maxpages;
+		stats->kcs_maxbytes += kn->kn_maxbufs * cp->kc_size;
+	}
+
+	if (stats->kcs_allocs > stats->kcs_frees)
+		stats->kcs_bytes = (stats->kcs_allocs - stats->kcs_frees) *
+		    cp->kc_size;
+}
+
+/*
+ * Sum up the sampled latencies of a cache.  Returns ENOTSUP, with
+ * everything zeroed, if the allocator was built without KMEM_LATENCY.
+ */
+int
+kmem_cache_getlatency(struct kmem_cache *cp, struct kmem_cache_latency *lat)
+{
+#ifdef KMEM_LATENCY
+	int i, j, k;
+#endif
+
+	KKASSERT((lat != NULL));
+
+	memset(lat, 0, sizeof(*lat));
+	lat->kcl_version = KMEM_LATENCY_VERSION;
+#ifdef KMEM_LATENCY
+	lat->kcl_sample = KMEM_LAT_SAMPLE;
+#if defined(__x86_64__) || defined(__i386__)
+	lat->kcl_tsc = 1;
+#endif
+	for (i = 0; i < kmem_ncpu; ++i) {
+		struct kmem_cpu_latency *cl;
+
+		cl = &cp->kc_cpu[i].kcc_lat;
+		for (j = 0; j < KMEM_LAT_NPATHS; j++) {
+			lat->kcl_ticks[j] += cl->kcl_ticks[j];
+			for (k = 0; k < KMEM_LAT_NBUCKETS; k++) {
+				lat->kcl_hist[j][k] += cl->kcl_hist[j][k];
+				lat->kcl_count[j] += cl->kcl_hist[j][k];
+			}
+		}
+	}
+	return 0;
+#else
+	return ENOTSUP;
+#endif
 }
 
 void
 kmem_cache_debug(struct kmem_cache *cp)
 {
+	struct kmem_cache_stats stats;
 	struct kmem_slab *slab;
-	struct kmem_magazine *mag;
 	unsigned empty, partial, full;
-	unsigned used;
-	int i;
+	unsigned nslabs[KS_NLISTS];
+	unsigned long used;
+	int i, j;
 
 	printf("kmem cache statistics for: %s\n", cp->kc_name);
 
-	for (i = 0; i < NCPU; ++i) {
+	kmem_cache_getstats(cp, &stats);
+	printf("allocs: %ju\tfrees: %ju\tslab allocs: %ju\thit ratio: %3ju%%\n",
+	    (uintmax_t)stats.kcs_allocs, (uintmax_t)stats.kcs_frees,
+	    (uintmax_t)stats.kcs_misses, stats.kcs_allocs == 0 ? 0 :
+	    (uintmax_t)((stats.kcs_allocs - MIN(stats.kcs_misses, stats.kcs_allocs)) *
+		100 / stats.kcs_allocs));
+	printf("bytes: %ju\tmax bytes: %ju\tpages: %ju\tmax pages: %ju\n",
+	    (uintmax_t)stats.kcs_bytes, (uintmax_t)stats.kcs_maxbytes,
+	    (uintmax_t)stats.kcs_pages, (uintmax_t)stats.kcs_maxpages);
+	printf("slabs created: %ju\tdestroyed: %ju\tslab frees: %ju\n",
+	    (uintmax_t)stats.kcs_slabcreates, (uintmax_t)stats.kcs_slabdestroys,
+	    (uintmax_t)stats.kcs_slabfrees);
+
+	for (i = 0; i < kmem_ncpu; ++i) {
 		struct kmem_cpu_cache *cpu;
+		struct kmem_cpu_stats *cs;
 
 		cpu = &cp->kc_cpu[i];
+		cs = &cpu->kcc_stats;
+		if (cs->kcs_allocs == 0 && cs->kcs_frees == 0)
+			continue;
 		printf("cpu%i:\n", i);
-		printf("\tallocs: %u\tmisses: %u\thit ratio: %3u%%\n", cpu->kcc_stats.kcs_allocs,
-		    cpu->kcc_stats.kcs_misses, (cpu->kcc_stats.kcs_allocs -
-			    cpu->kcc_stats.kcs_misses) * 100 / cpu->kcc_stats.kcs_allocs);
-		printf("\tmagazine misses: %u\n", cpu->kcc_stats.kcs_magmiss);
+		printf("\tallocs: %ju\tfrees: %ju\n", (uintmax_t)cs->kcs_allocs,
+		    (uintmax_t)cs->kcs_frees);
+		printf("\tmagazine misses: %ju\trefills: %ju\n",
+		    (uintmax_t)cs->kcs_magmiss, (uintmax_t)cs->kcs_refills);
+		printf("\tdepot full: %ju\tempty: %ju\tcontention: %ju\n",
+		    (uintmax_t)cs->kcs_depotfull, (uintmax_t)cs->kcs_depotempty,
+		    (uintmax_t)cs->kcs_depotcontention);
+		if (kmem_nnodes > 1)
+			printf("\tnode: %d\tremote frees: %ju\n", cpu->kcc_node,
+			    (uintmax_t)cs->kcs_remotefree);
 
 		printf("\tloaded: %i\tprevious: %i\n", cpu->kcc_rounds, cpu->kcc_prevrounds);
 	}
 
-	used = full = 0;
-	SLIST_FOREACH(mag, &cp->kc_fulldepot, km_entry) {
-		used += mag->km_rounds;
-		full++;
+#ifdef KMEM_LATENCY
+	{
+		static const char *pathnames[KMEM_LAT_NPATHS] = {
+			"alloc magazine", "alloc depot", "alloc slab",
+			"free magazine", "free depot", "free slab", "free remote"
+		};
+		struct kmem_cache_latency lat;
+		uint64_t seen;
+
+		/* Percentiles are upper bucket bounds */
+		kmem_cache_getlatency(cp, &lat);
+		printf("latency in %s, 1 in %u sampled:\n",
+		    lat.kcl_tsc ? "cycles" : "ns", lat.kcl_sample);
+		for (i = 0; i < KMEM_LAT_NPATHS; i++) {
+			int p50, p99;
+
+			if (lat.kcl_count[i] == 0)
+				continue;
+			p50 = p99 = -1;
+			seen = 0;
+			for (j = 0; j < KMEM_LAT_NBUCKETS; j++) {
+				seen += lat.kcl_hist[i][j];
+				if (p50 < 0 && seen * 2 >= lat.kcl_count[i])
+					p50 = j;
+				if (p99 < 0 && seen * 100 >= lat.kcl_count[i] * 99)
+					p99 = j;
+			}
+			printf("\t%s: %ju samples\tmean: %ju\tp50: <%ju\tp99: <%ju\n",
+			    pathnames[i], (uintmax_t)lat.kcl_count[i],
+			    (uintmax_t)(lat.kcl_ticks[i] / lat.kcl_count[i]),
+			    (uintmax_t)2 << p50, (uintmax_t)2 << p99);
+		}
+	}
+#endif
+
+	printf("magazine size: %d\n", cp->kc_magtype->mt_rounds);
+	printf("slab size: %u pages\tbufs: %u\t%s%s\n", cp->kc_pages, cp->kc_bufs,
+	    cp->kc_flags & KMC_HASH ? "hashed" :
+	    cp->kc_flags & KMC_BITMAP ? "inline, free map" : "inline",
+	    cp->kc_flags & KMC_HUGEPAGE ? "\thuge pages" : "");
+	printf("colors: %u\tstep: %u\t%s\n", cp->kc_maxcolor / cp->kc_colorstep + 1,
+	    cp->kc_colorstep, cp->kc_maxcolor == 0 ? "off" :
+	    cp->kc_flags & KMC_COLORRANDOM ? "random" : "sequential");
+
+	for (i = 0; i < kmem_nnodes; ++i) {
+		struct kmem_node *kn;
+
+		kn = &cp->kc_nodes[i];
+		if (kmem_nnodes > 1)
+			printf("node%i:\n", i);
+
+		/* Magazines in the full depot are always full */
+		full = kn->kn_fulldepot.kd_count;
+		printf("full depot: %u\ttotal rounds: %u\n", full,
+		    full * cp->kc_magtype->mt_rounds);
+		printf("empty depot: %u\n", kn->kn_emptydepot.kd_count);
+
+		kmem_lock(&kn->kn_slablock);
+		empty = partial = full = used = 0;
+		for (j = 0; j < KS_NLISTS; j++) {
+			nslabs[j] = 0;
+			TAILQ_FOREACH(slab, &kn->kn_slabs[j], ks_entry) {
+				nslabs[j]++;
+				used += slab->ks_refcnt;
+			}
+			if (j == KS_FREE)
+				full += nslabs[j];
+			else if (j == KS_USED)
+				empty += nslabs[j];
+			else
+				partial += nslabs[j];
+		}
+
+		printf("empty: %u\tpartial: %u\tfull: %u\n", empty, partial, full);
+		if (partial != 0) {
+			printf("partial by occupancy:");
+			for (j = 1; j <= KS_NPARTIAL; j++)
+				printf(" %u", nslabs[j]);
+			printf("\n");
+		}
+		/*
+		 * Fragmentation is the share of slab memory held by free
+		 * bufs that can't be reaped because their slab is in use.
+		 */
+		if (empty + partial != 0) {
+			unsigned long total, inuse;
+
+			total = (unsigned long)(empty + partial + full) * cp->kc_bufs;
+			inuse = (unsigned long)(empty + partial) * cp->kc_bufs;
+			printf("utilization: %5.1f%%\tfragmentation: %5.1f%%\n",
+			    used * 100.0 / total, (inuse - used) * 100.0 / total);
+		}
+
+		if (cp->kc_flags & KMC_HASH) {
+			unsigned long j;
+			unsigned chain, maxchain;
+
+			maxchain = 0;
+			for (j = 0; j <= kn->kn_hashmask; j++) {
+				struct kmem_bufctl *bufctl;
+
+				chain = 0;
+				SLIST_FOREACH(bufctl, &kn->kn_hashtab[j], kb_entry)
+					chain++;
+				if (chain > maxchain)
+					maxchain = chain;
+			}
+			printf("hash table: %lu buckets\t%lu bufs\tlongest chain: %u\n",
+			    kn->kn_hashmask + 1, kn->kn_hashcount, maxchain);
+		}
+		kmem_unlock(&kn->kn_slablock);
+	}
+}
+
+/*
+ * Write a snapshot of all caches to fp, in the KMEM_DUMP_TEXT or
+ * KMEM_DUMP_JSON format.  The cache list is locked for the whole dump,
+ * and each node's slab layer while it is counted, so the numbers of
+ * one cache are consistent with each other.  Returns 0, or -1 if
+ * writing failed.
+ *
+ * Slabs are counted by state: used ones have no free bufs left,
+ * partial ones some, and free ones only free bufs.  meta_bytes is
+ * what the slab layer spends on bookkeeping, in the slabs or outside
+ * of them, and waste_bytes the rest of the slab memory that can't
+ * hold objects: the slack after the bufs and the padding of each buf
+ * to kc_realsize.
+ */
+int
+kmem_dump(FILE *fp, int format)
+{
+	struct kmem_cache *cp;
+	int first;
+
+	KKASSERT((format == KMEM_DUMP_TEXT || format == KMEM_DUMP_JSON));
+
+	if (format == KMEM_DUMP_JSON) {
+		fprintf(fp, "{\"version\": %d, \"ncpu\": %d, \"nnodes\": %d, "
+		    "\"pagesize\": %d, \"caches\": [", KMEM_DUMP_VERSION,
+		    kmem_ncpu, kmem_nnodes, PAGESIZ);
+	} else {
+		fprintf(fp, "# kmem dump %d\n", KMEM_DUMP_VERSION);
+		fprintf(fp, "# name size realsize align pages bufs layout"
+		    " slabs_used slabs_partial slabs_free objs_active objs_total"
+		    " depot_full depot_empty magsize"
+		    " mem_bytes meta_bytes waste_bytes allocs frees\n");
+	}
+
+	first = 1;
+	kmem_lock(&kmem_cachelock);
+	TAILQ_FOREACH(cp, &kmem_caches, kc_entry) {
+		kmem_cache_dump(fp, cp, format, first);
+		first = 0;
+	}
+	kmem_unlock(&kmem_cachelock);
+
+	if (format == KMEM_DUMP_JSON)
+		fprintf(fp, "\n]}\n");
+
+	if (fflush(fp) != 0 || ferror(fp))
+		return -1;
+	return 0;
+}
+
+/*
+ * Dump one cache, see kmem_dump().  The numbers are gathered first,
+ * so the slab locks aren't held while writing, which might allocate.
+ */
+static void
+kmem_cache_dump(FILE *fp, struct kmem_cache *cp, int format, int first)
+{
+	struct kmem_cache_stats stats;
+	struct kmem_slab *slab;
+	const char *layout;
+	unsigned long slabs[3];		/* Used, partial, free */
+	unsigned long active, carved, depotfull, depotempty;
+	uint64_t mem, meta, waste;
+	int i, j;
+
+	slabs[0] = slabs[1] = slabs[2] = 0;
+	active = carved = depotfull = depotempty = 0;
+	meta = 0;
+	for (i = 0; i < kmem_nnodes; ++i) {
+		struct kmem_node *kn;
+
+		kn = &cp->kc_nodes[i];
+		depotfull += kn->kn_fulldepot.kd_count;
+		depotempty += kn->kn_emptydepot.kd_count;
+
+		kmem_lock(&kn->kn_slablock);
+		for (j = 0; j < KS_NLISTS; j++) {
+			TAILQ_FOREACH(slab, &kn->kn_slabs[j], ks_entry) {
+				if (j == KS_USED)
+					slabs[0]++;
+				else if (j == KS_FREE)
+					slabs[2]++;
+				else
+					slabs[1]++;
+				active += slab->ks_refcnt;
+				carved += slab->ks_carved;
+			}
+		}
+		if (cp->kc_flags & KMC_HASH)
+			meta += (kn->kn_hashmask + 1) * sizeof(kmem_hashentry);
+		kmem_unlock(&kn->kn_slablock);
+	}
+	kmem_cache_getstats(cp, &stats);
+
+	/*
+	 * Hashed caches keep their slab data and a bufctl per carved
+	 * buf outside the slab, and the slab entirely for the bufs.
+	 */
+	mem = (uint64_t)(slabs[0] + slabs[1] + slabs[2]) * cp->kc_pages * PAGESIZ;
+	waste = mem - (uint64_t)(slabs[0] + slabs[1] + slabs[2]) * cp->kc_bufs *
+	    cp->kc_size;
+	if (cp->kc_flags & KMC_HASH) {
+		meta += (slabs[0] + slabs[1] + slabs[2]) * sizeof(struct kmem_slab) +
+		    carved * sizeof(struct kmem_bufctl);
+		layout = "hashed";
+	} else {
+		uint64_t inslab;
+
+		inslab = (uint64_t)(slabs[0] + slabs[1] + slabs[2]) * cp->kc_slabhdr;
+		if ((cp->kc_ctor != NULL || cp->kc_slabctor != NULL) &&
+		    !(cp->kc_flags & KMC_BITMAP))
+			inslab += (uint64_t)(slabs[0] + slabs[1] + slabs[2]) *
+			    cp->kc_bufs * sizeof(struct kmem_bufctl_inline);
+		meta += inslab;
+		waste -= inslab;
+		layout = cp->kc_flags & KMC_BITMAP ? "bitmap" : "inline";
 	}
-	printf("full depot: %u\ttotal rounds: %u\n", full, used);
 
-	empty = 0;
-	SLIST_FOREACH(mag, &cp->kc_emptydepot, km_entry) {
-		empty++;
+	if (format == KMEM_DUMP_JSON) {
+		fprintf(fp, "%s\n  {\"name\": \"", first ? "" : ",");
+		kmem_dump_name(fp, cp->kc_name, format);
+		fprintf(fp, "\", \"size\": %zu, \"realsize\": %zu, "
+		    "\"align\": %u, \"pages\": %u, \"bufs\": %u, "
+		    "\"layout\": \"%s\", \"hugepage\": %s, ",
+		    cp->kc_size, cp->kc_realsize, cp->kc_align, cp->kc_pages,
+		    cp->kc_bufs, layout,
+		    cp->kc_flags & KMC_HUGEPAGE ? "true" : "false");
+		fprintf(fp, "\"slabs_used\": %lu, \"slabs_partial\": %lu, "
+		    "\"slabs_free\": %lu, \"objs_active\": %lu, "
+		    "\"objs_total\": %lu, ", slabs[0], slabs[1], slabs[2],
+		    active, (slabs[0] + slabs[1] + slabs[2]) * cp->kc_bufs);
+		fprintf(fp, "\"depot_full\": %lu, \"depot_empty\": %lu, "
+		    "\"magsize\": %d, ", depotfull, depotempty,
+		    cp->kc_magtype->mt_rounds);
+		fprintf(fp, "\"mem_bytes\": %ju, \"meta_bytes\": %ju, "
+		    "\"waste_bytes\": %ju, \"allocs\": %ju, \"frees\": %ju}",
+		    (uintmax_t)mem, (uintmax_t)meta, (uintmax_t)waste,
+		    (uintmax_t)stats.kcs_allocs, (uintmax_t)stats.kcs_frees);
+	} else {
+		kmem_dump_name(fp, cp->kc_name, format);
+		fprintf(fp, " %zu %zu %u %u %u %s", cp->kc_size, cp->kc_realsize,
+		    cp->kc_align, cp->kc_pages, cp->kc_bufs, layout);
+		fprintf(fp, " %lu %lu %lu %lu %lu", slabs[0], slabs[1], slabs[2],
+		    active, (slabs[0] + slabs[1] + slabs[2]) * cp->kc_bufs);
+		fprintf(fp, " %lu %lu %d", depotfull, depotempty,
+		    cp->kc_magtype->mt_rounds);
+		fprintf(fp, " %ju %ju %ju %ju %ju\n", (uintmax_t)mem,
+		    (uintmax_t)meta, (uintmax_t)waste,
+		    (uintmax_t)stats.kcs_allocs, (uintmax_t)stats.kcs_frees);
 	}
-	printf("empty depot: %u\n", empty);
+}
 
-	empty = partial = full = used = 0;
-	TAILQ_FOREACH(slab, &cp->kc_slabs, ks_entry) {
-		if (slab->ks_refcnt == 0) {
-			full++;
-		} else if (SLIST_EMPTY(&slab->ks_freebufs)) {
-			empty++;
+/*
+ * Cache names are free-form.  The text format separates fields by
+ * blanks, so those become underscores; JSON needs quotes, backslashes
+ * and control characters escaped.
+ */
+static void
+kmem_dump_name(FILE *fp, const char *name, int format)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)name; *p != '\0'; p++) {
+		if (format == KMEM_DUMP_TEXT) {
+			putc(*p <= ' ' || *p == 0x7f ? '_' : *p, fp);
+		} else if (*p == '"' || *p == '\\') {
+			putc('\\', fp);
+			putc(*p, fp);
+		} else if (*p < ' ') {
+			fprintf(fp, "\\u%04x", *p);
 		} else {
-			partial++;
-			used += slab->ks_refcnt;
+			putc(*p, fp);
+		}
+	}
+}
+
+#ifdef KMEM_RECORD
+/*
+ * Start recording an allocation trace to path, see struct
+ * kmem_record.  Existing caches are recorded as created first.
+ * Returns 0, or an errno.
+ */
+int
+kmem_record_start(const char *path)
+{
+	static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+	struct kmem_record_header hdr;
+	struct kmem_cache *cp;
+	struct timespec ts;
+	int fd, error;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return errno;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.krh_magic = KMEM_RECORD_MAGIC;
+	hdr.krh_version = KMEM_RECORD_VERSION;
+	hdr.krh_recsize = sizeof(struct kmem_record);
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		error = errno;
+		close(fd);
+		return error;
+	}
+
+	/* A forked child would mix its records into the parent's */
+	pthread_once(&atfork_once, kmem_record_atfork);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	kmem_lock(&kmem_rec_lock);
+	if (kmem_rec_fd >= 0) {
+		kmem_unlock(&kmem_rec_lock);
+		close(fd);
+		return EBUSY;
+	}
+	kmem_rec_fd = fd;
+	kmem_rec_start = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	kmem_rec_count = 0;
+	kmem_unlock(&kmem_rec_lock);
+
+	/*
+	 * Caches created from now on record themselves.  One created
+	 * meanwhile might be recorded twice, which replay ignores.
+	 */
+	kmem_lock(&kmem_cachelock);
+	TAILQ_FOREACH(cp, &kmem_caches, kc_entry) {
+		if (cp->kc_recid != 0)
+			kmem_record(KMEM_REC_CREATE, cp, NULL);
+	}
+	kmem_recording = 1;
+	kmem_unlock(&kmem_cachelock);
+
+	return 0;
+}
+
+/*
+ * Write out the rest of the trace and close it.
+ */
+void
+kmem_record_stop(void)
+{
+	kmem_lock(&kmem_rec_lock);
+	kmem_recording = 0;
+	if (kmem_rec_fd >= 0) {
+		kmem_record_flush();
+		if (kmem_rec_fd >= 0)
+			close(kmem_rec_fd);
+		kmem_rec_fd = -1;
+	}
+	kmem_unlock(&kmem_rec_lock);
+}
+
+static void
+kmem_record(int op, struct kmem_cache *cp, void *obj)
+{
+	struct kmem_record *kr;
+	struct timespec ts;
+
+	if (op == KMEM_REC_ALLOC && obj == NULL)
+		return;
+	if (kmem_rec_thread == 0)
+		kmem_rec_thread = __sync_add_and_fetch(&kmem_rec_nthreads, 1);
+
+	kmem_lock(&kmem_rec_lock);
+	if (kmem_rec_fd < 0) {
+		kmem_unlock(&kmem_rec_lock);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	kr = &kmem_rec_buf[kmem_rec_count++];
+	kr->kr_time = ts.tv_sec * 1000000000UL + ts.tv_nsec - kmem_rec_start;
+	kr->kr_obj = op == KMEM_REC_CREATE ? cp->kc_align : (uintptr_t)obj;
+	kr->kr_cache = cp->kc_recid;
+	kr->kr_size = cp->kc_size;
+	kr->kr_thread = kmem_rec_thread;
+	kr->kr_op = op;
+	if (kmem_rec_count == KMEM_REC_BUFSIZE)
+		kmem_record_flush();
+	kmem_unlock(&kmem_rec_lock);
+}
+
+/*
+ * Write the buffered records.  If that fails, the trace ends there.
+ * Called with kmem_rec_lock held.
+ */
+static void
+kmem_record_flush(void)
+{
+	const char *p;
+	size_t left;
+	ssize_t n;
+
+	p = (const char *)kmem_rec_buf;
+	left = kmem_rec_count * sizeof(kmem_rec_buf[0]);
+	kmem_rec_count = 0;
+	while (left > 0) {
+		n = write(kmem_rec_fd, p, left);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			kmem_recording = 0;
+			close(kmem_rec_fd);
+			kmem_rec_fd = -1;
+			return;
 		}
+		p += n;
+		left -= n;
 	}
+}
+
+static void
+kmem_record_child(void)
+{
+	kmem_recording = 0;
+	kmem_rec_count = 0;
+	if (kmem_rec_fd >= 0)
+		close(kmem_rec_fd);
+	kmem_rec_fd = -1;
+	kmem_lock_init(&kmem_rec_lock);
+}
+
+static void
+kmem_record_atfork(void)
+{
+	pthread_atfork(NULL, NULL, kmem_record_child);
+}
+#else
+int
+kmem_record_start(const char *path)
+{
+	return ENOTSUP;
+}
+
+void
+kmem_record_stop(void)
+{
+}
+#endif
+
+static kmem_hashentry *
+kmem_bufaddr_makehash(struct kmem_cache *cp, struct kmem_node *kn,
+		void *bufaddr)
+{
+	return &kn->kn_hashtab[((unsigned long)bufaddr >> cp->kc_hashshift) &
+	    kn->kn_hashmask];
+}
+
+/*
+ * The initial table comes from its own cache, larger ones directly
+ * from the page layer.
+ */
+static kmem_hashentry *
+kmem_hash_alloc(unsigned long size)
+{
+	kmem_hashentry *tab;
+	unsigned long i;
+
+	if (size == KH_MINSIZE)
+		tab = kmem_cache_alloc(hashtab_cch, M_WAITOK);
+	else
+		tab = kmem_get_pages(kmem_arena, howmany(size * sizeof(*tab), PAGESIZ),
+		    M_WAITOK);
+	if (tab == NULL)
+		return NULL;
+
+	for (i = 0; i < size; i++)
+		SLIST_INIT(&tab[i]);
+
+	return tab;
+}
+
+static void
+kmem_hash_free(kmem_hashentry *tab, unsigned long size)
+{
+	if (size == KH_MINSIZE)
+		kmem_cache_free(hashtab_cch, tab);
+	else
+		kmem_return_pages(kmem_arena, tab, howmany(size * sizeof(*tab), PAGESIZ));
+}
+
+/*
+ * Move all bufctls to a table with size buckets.  The table grows
+ * when it holds more than two bufctls per bucket on average, so free
+ * doesn't get slower with the number of outstanding bufs.  Called
+ * with the slab lock held.
+ */
+static void
+kmem_hash_rescale(struct kmem_cache *cp, struct kmem_node *kn,
+		unsigned long size)
+{
+	kmem_hashentry *oldtab;
+	unsigned long oldsize, i;
+	struct kmem_bufctl *bufctl;
+
+	oldtab = kn->kn_hashtab;
+	oldsize = kn->kn_hashmask + 1;
+
+	kn->kn_hashtab = kmem_hash_alloc(size);
+	if (kn->kn_hashtab == NULL) {
+		/* Keep going with the old one */
+		kn->kn_hashtab = oldtab;
+		return;
+	}
+	kn->kn_hashmask = size - 1;
+
+	for (i = 0; i < oldsize; i++) {
+		while ((bufctl = SLIST_FIRST(&oldtab[i])) != NULL) {
+			SLIST_REMOVE_HEAD(&oldtab[i], kb_entry);
+			SLIST_INSERT_HEAD(kmem_bufaddr_makehash(cp, kn, bufctl->kb_buf),
+			    bufctl, kb_entry);
+		}
+	}
+
+	kmem_hash_free(oldtab, oldsize);
+}
+
+static void
+kmem_depot_init(struct kmem_depot *kd)
+{
+#ifdef KMEM_LOCKFREE_DEPOT
+	kd->kd_top.kdt_mag = NULL;
+	kd->kd_top.kdt_gen = 0;
+#else
+	kmem_lock_init(&kd->kd_lock);
+	SLIST_INIT(&kd->kd_mags);
+#endif
+	kd->kd_count = 0;
+	kd->kd_min = kd->kd_reaplimit = 0;
+}
+
+static void
+kmem_depot_destroy(struct kmem_depot *kd)
+{
+	KKASSERT((kd->kd_count == 0));
+#ifndef KMEM_LOCKFREE_DEPOT
+	kmem_lock_destroy(&kd->kd_lock);
+#endif
+}
+
+#ifdef KMEM_LOCKFREE_DEPOT
+/*
+ * The halves of the top are read separately.  A torn read only
+ * makes the CAS fail, and each half alone is a valid value.
+ */
+static struct kmem_magazine *
+kmem_depot_get(struct kmem_depot *kd, struct kmem_cpu_cache *cpu)
+{
+	union kmem_depot_top old, new;
+	unsigned int count;
+
+	for (;;) {
+		old.kdt_gen = kd->kd_top.kdt_gen;
+		old.kdt_mag = kd->kd_top.kdt_mag;
+		if (old.kdt_mag == NULL)
+			return NULL;
+
+		new.kdt_mag = *(struct kmem_magazine * volatile *)
+			&SLIST_NEXT(old.kdt_mag, km_entry);
+		new.kdt_gen = old.kdt_gen + 1;
+		if (__sync_bool_compare_and_swap(&kd->kd_top.kdt_word,
+		    old.kdt_word, new.kdt_word))
+			break;
+
+		if (cpu != NULL)
+			cpu->kcc_stats.kcs_depotcontention++;
+	}
+	count = __sync_sub_and_fetch(&kd->kd_count, 1);
+	if (count < kd->kd_min)
+		kd->kd_min = count;	/* Racy, but only an estimate */
+
+	return old.kdt_mag;
+}
+
+static void
+kmem_depot_put(struct kmem_depot *kd, struct kmem_magazine *mag,
+		struct kmem_cpu_cache *cpu)
+{
+	union kmem_depot_top old, new;
+
+	/*
+	 * Count the magazine before it can be taken, or a get could
+	 * take the count below zero.
+	 */
+	__sync_fetch_and_add(&kd->kd_count, 1);
+	new.kdt_mag = mag;
+	for (;;) {
+		old.kdt_gen = kd->kd_top.kdt_gen;
+		old.kdt_mag = kd->kd_top.kdt_mag;
+
+		SLIST_NEXT(mag, km_entry) = old.kdt_mag;
+		new.kdt_gen = old.kdt_gen + 1;
+		if (__sync_bool_compare_and_swap(&kd->kd_top.kdt_word,
+		    old.kdt_word, new.kdt_word))
+			break;
+
+		if (cpu != NULL)
+			cpu->kcc_stats.kcs_depotcontention++;
+	}
+}
+#else
+static __inline void
+kmem_depot_lock(struct kmem_depot *kd, struct kmem_cpu_cache *cpu)
+{
+	if (kmem_trylock(&kd->kd_lock))
+		return;
+
+	if (cpu != NULL)
+		cpu->kcc_stats.kcs_depotcontention++;
+	kmem_lock(&kd->kd_lock);
+}
+
+static struct kmem_magazine *
+kmem_depot_get(struct kmem_depot *kd, struct kmem_cpu_cache *cpu)
+{
+	struct kmem_magazine *mag;
+
+	kmem_depot_lock(kd, cpu);
+	mag = SLIST_FIRST(&kd->kd_mags);
+	if (mag != NULL) {
+		SLIST_REMOVE_HEAD(&kd->kd_mags, km_entry);
+		if (--kd->kd_count < kd->kd_min)
+			kd->kd_min = kd->kd_count;
+	}
+	kmem_unlock(&kd->kd_lock);
+
+	return mag;
+}
+
+static void
+kmem_depot_put(struct kmem_depot *kd, struct kmem_magazine *mag,
+		struct kmem_cpu_cache *cpu)
+{
+	kmem_depot_lock(kd, cpu);
+	SLIST_INSERT_HEAD(&kd->kd_mags, mag, km_entry);
+	kd->kd_count++;
+	kmem_unlock(&kd->kd_lock);
+}
+#endif
+
+/*
+ * Free the magazines the depot didn't need over the last two
+ * intervals, and start a new interval.  The minimum depot size over
+ * an interval is the part of it the working set didn't touch.
+ */
+static void
+kmem_depot_ws_reap(struct kmem_cache *cp, struct kmem_node *kn,
+		struct kmem_depot *kd)
+{
+	struct kmem_magazine *mag;
+	unsigned int reap;
+
+	reap = MIN(kd->kd_reaplimit, kd->kd_min);
+	while (reap-- > 0 && (mag = kmem_depot_get(kd, NULL)) != NULL)
+		kmem_magazine_destroy(cp, kn, mag);
+
+	kd->kd_reaplimit = kd->kd_min;
+	kd->kd_min = kd->kd_count;
+}
+
+static void
+kmem_depot_drain(struct kmem_cache *cp, struct kmem_node *kn,
+		struct kmem_depot *kd)
+{
+	struct kmem_magazine *mag;
+
+	while ((mag = kmem_depot_get(kd, NULL)) != NULL)
+		kmem_magazine_destroy(cp, kn, mag);
+}
+
+/*
+ * Check whether the cache should move to larger magazines.  This
+ * runs from the magazine miss paths, without any locks held.
+ */
+static void
+kmem_cache_magazine_update(struct kmem_cache *cp)
+{
+	struct kmem_cache_stats stats;
+	unsigned long now, last;
+	unsigned int allocs, magmiss, contention;
+
+	now = kmem_gettime();
+	last = cp->kc_magupdate;
+	if (now - last < KM_UPDATE_INTERVAL ||
+	    !__sync_bool_compare_and_swap(&cp->kc_magupdate, last, now))
+		return;
+
+	kmem_cache_getstats(cp, &stats);
+	allocs = stats.kcs_allocs - cp->kc_magstats.kcs_allocs;
+	magmiss = stats.kcs_magmiss - cp->kc_magstats.kcs_magmiss;
+	contention = stats.kcs_depotcontention -
+		cp->kc_magstats.kcs_depotcontention;
+	cp->kc_magstats = stats;
+
+	if (cp->kc_magtype == &kmem_magtypes[KM_NMAGTYPES - 1])
+		return;
+
+	if (contention > KM_RESIZE_CONTENTION ||
+	    (allocs >= KM_RESIZE_MINALLOCS &&
+	     magmiss > allocs / KM_RESIZE_MISSRATIO)) {
+		cp->kc_magtype++;
+		kmem_cache_magazine_purge(cp);
+	}
+}
+
+/*
+ * Return all magazines of the cache to the slab layer, and switch the
+ * CPUs over to the current magazine type.  Magazines of the old type
+ * that are pushed into the depot concurrently are thrown away when
+ * they are fetched again.
+ */
+static void
+kmem_cache_magazine_purge(struct kmem_cache *cp)
+{
+	struct kmem_magazine *alien[KMEM_MAXNODES];
+	struct kmem_node *kn;
+	int i, j;
+
+	for (i = 0; i < kmem_ncpu; ++i) {
+		struct kmem_cpu_cache *cpu;
+		struct kmem_magazine *loaded, *previous;
+
+		cpu = &cp->kc_cpu[i];
+		kn = &cp->kc_nodes[cpu->kcc_node];
+
+		kmem_lock(&cpu->kcc_lock);
+		loaded = cpu->kcc_loaded;
+		if (loaded != NULL)
+			loaded->km_rounds = cpu->kcc_rounds;
+		previous = cpu->kcc_previous;
+		if (previous != NULL)
+			previous->km_rounds = cpu->kcc_prevrounds;
+		cpu->kcc_loaded = cpu->kcc_previous = NULL;
+		cpu->kcc_rounds = cpu->kcc_prevrounds = -1;
+		cpu->kcc_magsize = cp->kc_magtype->mt_rounds;
+		memcpy(alien, cpu->kcc_alien, kmem_nnodes * sizeof(*alien));
+		memset(cpu->kcc_alien, 0, kmem_nnodes * sizeof(*alien));
+		kmem_unlock(&cpu->kcc_lock);
+
+		if (loaded != NULL)
+			kmem_magazine_destroy(cp, kn, loaded);
+		if (previous != NULL)
+			kmem_magazine_destroy(cp, kn, previous);
+		for (j = 0; j < kmem_nnodes; ++j) {
+			if (alien[j] != NULL)
+				kmem_magazine_destroy(cp, &cp->kc_nodes[j], alien[j]);
+		}
+	}
+
+	for (i = 0; i < kmem_nnodes; ++i) {
+		kn = &cp->kc_nodes[i];
+		kmem_depot_drain(cp, kn, &kn->kn_fulldepot);
+		kmem_depot_drain(cp, kn, &kn->kn_emptydepot);
+	}
+}
+
+static struct kmem_slab *
+kmem_alloc_slab(struct kmem_cache *cp, struct kmem_node *kn, int flags)
+{
+	void *pages;
+	struct kmem_slab *slab;
+	uint64_t pages_held;
+
+	/* Get the memory, aligned if the slab header is inline */
+	if (cp->kc_flags & KMC_HASH)
+		pages = kmem_get_pages(kn->kn_arena, cp->kc_pages, flags);
+	else
+		pages = kmem_get_aligned_pages(kn->kn_arena, cp->kc_pages, flags);
+	if (pages == NULL)
+		return NULL;
+
+	/*
+	 * If the slab isn't naturally aligned, we can't inline
+	 * the administrative data and need to allocate it
+	 * separately.
+	 */
+	if (cp->kc_flags & KMC_HASH) {
+		/* XXX recursion? */
+		slab = kmem_cache_alloc(slab_cch, flags);
+		if (slab == NULL) {
+			kmem_return_pages(kn->kn_arena, pages, cp->kc_pages);
+			return NULL;
+		}
+	}
+	/*
+	 * This cache uses slabs with inlined administative
+	 * information. Probably the hot path.
+	 */
+	else {
+		/*
+		 * Struct kmem_slab resides at the very end of the slab
+		 * when administrative data is stored inline.
+		 */
+		slab = pages + cp->kc_pages * PAGESIZ - cp->kc_slabhdr;
+	}
+
+	if (cp->kc_flags & KMC_BITMAP) {
+		unsigned int nwords, i;
+
+		nwords = howmany(cp->kc_bufs, KS_MAPBITS);
+		for (i = 0; i < nwords; i++)
+			slab->ks_freemap[i] = ~0UL;
+		if (cp->kc_bufs % KS_MAPBITS != 0)
+			slab->ks_freemap[nwords - 1] =
+			    (1UL << (cp->kc_bufs % KS_MAPBITS)) - 1;
+		slab->ks_maphint = 0;
+	}
+
+	/*
+	 * Bufs are carved off ks_base on demand, so a new slab touches
+	 * no buf memory and needs no bufctls yet.  Only bufs that were
+	 * freed again go on the freelist.
+	 */
+	SLIST_INIT(&slab->ks_freebufs);
+	slab->ks_carved = 0;
+	slab->ks_refcnt = 0;
+	slab->ks_page = pages;
+	slab->ks_base = pages + kmem_slab_color(cp, kn);
+	vmem_setowner(pages, cp->kc_pages, cp);
+
+	kn->kn_slabcreates++;
+	pages_held = __sync_add_and_fetch(&kn->kn_pages, cp->kc_pages);
+	if (pages_held > kn->kn_maxpages)
+		kn->kn_maxpages = pages_held;
+	KMEM_PROBE2(slab__create, cp, slab);
+
+	return slab;
+}
+
+/*
+ * Pick the color of a new slab, either the next one in turn or a
+ * random one.  Called with the node's slab lock held.
+ */
+static unsigned int
+kmem_slab_color(struct kmem_cache *cp, struct kmem_node *kn)
+{
+	unsigned int color, seed;
+
+	if (cp->kc_maxcolor == 0)
+		return 0;
+
+	if (cp->kc_flags & KMC_COLORRANDOM) {
+		/* xorshift32 */
+		seed = kn->kn_colorseed;
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		kn->kn_colorseed = seed;
+
+		return seed % (cp->kc_maxcolor / cp->kc_colorstep + 1) *
+		    cp->kc_colorstep;
+	}
+
+	color = kn->kn_color;
+	kn->kn_color += cp->kc_colorstep;
+	if (kn->kn_color > cp->kc_maxcolor)
+		kn->kn_color = 0;
+
+	return color;
+}
+
+/*
+ * Construct all bufs of a new slab, so the slab layer only ever holds
+ * constructed bufs.  Called without locks, as the constructor might
+ * allocate.
+ */
+static void
+kmem_construct_slab(struct kmem_cache *cp, struct kmem_slab *slab)
+{
+	unsigned int i;
+
+	if (cp->kc_slabctor != NULL) {
+		cp->kc_slabctor(slab->ks_base, cp->kc_bufs, cp->kc_realsize);
+		return;
+	}
+
+	for (i = 0; i < cp->kc_bufs; i++)
+		cp->kc_ctor(slab->ks_base + i * cp->kc_realsize, cp->kc_size);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *cp, int flags)
+{
+	struct kmem_cpu_cache *cpu;
+	struct kmem_magazine *mag;
+	struct kmem_node *kn;
+	void *obj;
+	KMEM_LAT_DECL;
+
+	KMEM_LAT_BEGIN(KMEM_LAT_ALLOC_MAG);
+	cpu = kmem_cpu_cache(cp);
+	kmem_lock(&cpu->kcc_lock);
+
+	cpu->kcc_stats.kcs_allocs++;
+
+retry:
+	kn = &cp->kc_nodes[cpu->kcc_node];
+
+	/*
+	 * If the loaded magazine still has rounds in it,
+	 * take one and return.
+	 */
+	if (cpu->kcc_rounds > 0) {
+		mag = cpu->kcc_loaded;
+
+alloc_loaded:
+		obj = mag->km_round[--cpu->kcc_rounds];
+		kmem_unlock(&cpu->kcc_lock);
+		KMEM_PROBE2(alloc__loaded, cp, obj);
+		KMEM_LAT_END(cpu);
+		KMEM_RECORD_OP(KMEM_REC_ALLOC, cp, obj);
+		return obj;
+	}
+
+	/*
+	 * The loaded magazine had drained. If there are rounds in
+	 * the previous magazine, swap them and try again.
+	 */
+	if (cpu->kcc_prevrounds > 0) {
+		cpu->kcc_rounds = cpu->kcc_prevrounds;
+		cpu->kcc_prevrounds = 0;
+
+		mag = cpu->kcc_previous;
+		cpu->kcc_previous = cpu->kcc_loaded;
+		cpu->kcc_loaded = mag;
+
+		KMEM_PROBE1(alloc__previous, cp);
+		goto alloc_loaded;
+	}
+
+	/*
+	 * Both magazines are empty (or not allocated), so return an
+	 * empty one and load a full one.
+	 */
+	KMEM_LAT_PATH(KMEM_LAT_ALLOC_DEPOT);
+	if ((mag = kmem_depot_get(&kn->kn_fulldepot, cpu)) != NULL) {
+		cpu->kcc_stats.kcs_depotfull++;
+		KMEM_PROBE2(alloc__depot, cp, mag);
+		if (mag->km_type->mt_rounds != cpu->kcc_magsize) {
+			/* Left over from before a resize */
+			kmem_unlock(&cpu->kcc_lock);
+			kmem_magazine_destroy(cp, kn, mag);
+			cpu = kmem_cpu_cache(cp);
+			kmem_lock(&cpu->kcc_lock);
+			goto retry;
+		}
+
+		/*
+		 * If the previous magazine is not allocated, the loaded
+		 * could also not be allocated. In both cases just put loaded
+		 * into the free previous slot.
+		 * If the previous magazine is allocated, loaded is too.
+		 */
+		if (cpu->kcc_previous == NULL) {
+			cpu->kcc_previous = cpu->kcc_loaded;
+			cpu->kcc_prevrounds = cpu->kcc_rounds;
+		} else {
+			cpu->kcc_loaded->km_rounds = 0;
+			kmem_depot_put(&kn->kn_emptydepot, cpu->kcc_loaded, cpu);
+		}
+
+		cpu->kcc_loaded = mag;
+		cpu->kcc_rounds = mag->km_rounds;
+
+		goto alloc_loaded;
+	}
+
+	cpu->kcc_stats.kcs_magmiss++;
+	kmem_unlock(&cpu->kcc_lock);
+	KMEM_PROBE1(alloc__miss, cp);
+	KMEM_LAT_PATH(KMEM_LAT_ALLOC_SLAB);
+
+	kmem_cache_magazine_update(cp);
+
+	/*
+	 * Magazine caches take single objects: a refill would need a
+	 * magazine from a magazine cache again.
+	 */
+	if (!(cp->kc_flags & KMC_MAGAZINE))
+		obj = kmem_cache_alloc_refill(cp, kn, flags);
+	else if (kmem_alloc_from_slab(cp, kn, flags, 1, &obj) == 0)
+		obj = NULL;
+
+	KMEM_LAT_END(cpu);
+	KMEM_RECORD_OP(KMEM_REC_ALLOC, cp, obj);
+	return obj;
+}
+
+/*
+ * Both magazines and the full depot are empty.  Instead of taking a
+ * single object from the slab layer and missing again on the next
+ * allocation, fill a whole magazine from the slabs in one pass, and
+ * load it.  Returns one of the objects.
+ */
+static void *
+kmem_cache_alloc_refill(struct kmem_cache *cp, struct kmem_node *kn,
+		int flags)
+{
+	struct kmem_cpu_cache *cpu;
+	struct kmem_magazine *mag;
+	struct kmem_magtype *mt;
+	size_t got;
+	void *obj;
+
+	mt = cp->kc_magtype;
+	mag = kmem_depot_get(&kn->kn_emptydepot, NULL);
+	if (mag != NULL && mag->km_type != mt) {
+		/* Left over from before a resize */
+		kmem_magazine_destroy(cp, kn, mag);
+		mag = NULL;
+	}
+	if (mag == NULL) {
+		mag = kmem_cache_alloc(mt->mt_cache, 0);	/* XXX flags */
+		if (mag == NULL) {
+			if (kmem_alloc_from_slab(cp, kn, flags, 1, &obj) == 0)
+				return NULL;
+			return obj;
+		}
+		mag->km_type = mt;
+	}
+
+	got = kmem_alloc_from_slab(cp, kn, flags, mt->mt_rounds,
+	    (void **)mag->km_round);
+	if (got == 0) {
+		mag->km_rounds = 0;
+		kmem_depot_put(&kn->kn_emptydepot, mag, NULL);
+		return NULL;
+	}
+	obj = mag->km_round[--got];
+	mag->km_rounds = got;
+
+	/*
+	 * Load the magazine, unless we moved to another node in the
+	 * meantime, the magazine size changed, or frees refilled the
+	 * loaded magazine.  Then the rounds go back to the slabs.
+	 */
+	cpu = kmem_cpu_cache(cp);
+	kmem_lock(&cpu->kcc_lock);
+	if (got > 0 && &cp->kc_nodes[cpu->kcc_node] == kn &&
+	    mt->mt_rounds == cpu->kcc_magsize && cpu->kcc_rounds <= 0) {
+		if (cpu->kcc_previous == NULL) {
+			cpu->kcc_previous = cpu->kcc_loaded;
+			cpu->kcc_prevrounds = cpu->kcc_rounds;
+		} else {
+			cpu->kcc_loaded->km_rounds = 0;
+			kmem_depot_put(&kn->kn_emptydepot, cpu->kcc_loaded, cpu);
+		}
+
+		cpu->kcc_loaded = mag;
+		cpu->kcc_rounds = got;
+		cpu->kcc_stats.kcs_refills++;
+		kmem_unlock(&cpu->kcc_lock);
+		KMEM_PROBE2(alloc__refill, cp, got);
+		return obj;
+	}
+	kmem_unlock(&cpu->kcc_lock);
+
+	kmem_empty_magazine(cp, kn, mag);
+	kmem_depot_put(&kn->kn_emptydepot, mag, NULL);
+	return obj;
+}
+
+/*
+ * Allocate n objects into objs.  Runs of rounds are taken from the
+ * magazines at once, and whatever they can't supply comes straight
+ * from the slab layer.  Returns the number of objects allocated,
+ * which is less than n only if the slab layer ran out of memory.
+ */
+size_t
+kmem_cache_alloc_bulk(struct kmem_cache *cp, int flags, size_t n, void **objs)
+{
+	struct kmem_cpu_cache *cpu;
+	struct kmem_magazine *mag;
+	struct kmem_node *kn;
+	size_t done, cnt;
+
+	done = 0;
+
+	cpu = kmem_cpu_cache(cp);
+	kmem_lock(&cpu->kcc_lock);
+
+	cpu->kcc_stats.kcs_allocs += n;
+
+	while (done < n) {
+		kn = &cp->kc_nodes[cpu->kcc_node];
+
+		/* Take as many rounds as possible from the loaded magazine */
+		if (cpu->kcc_rounds > 0) {
+			cnt = MIN(n - done, (size_t)cpu->kcc_rounds);
+			cpu->kcc_rounds -= cnt;
+			memcpy(&objs[done], &cpu->kcc_loaded->km_round[cpu->kcc_rounds],
+			    cnt * sizeof(*objs));
+			done += cnt;
+			continue;
+		}
 
-	printf("empty: %u\tpartial: %u\tfull: %u\n", empty, partial, full);
-	printf("fragmentation: %3u%%\n", used / cp->kc_bufs * 100 / (empty + partial + full));
+		/* Then from the previous one */
+		if (cpu->kcc_prevrounds > 0) {
+			cpu->kcc_rounds = cpu->kcc_prevrounds;
+			cpu->kcc_prevrounds = 0;
 
-	if (cp->kc_pages > 1) {
-		unsigned i;
+			mag = cpu->kcc_previous;
+			cpu->kcc_previous = cpu->kcc_loaded;
+			cpu->kcc_loaded = mag;
+			continue;
+		}
 
-		printf("hash map distribution:\n");
-		for (i = 0; i < KH_NUM; i++) {
-			unsigned bufs;
-			struct kmem_bufctl *bufctl;
+		/* Exchange the empty loaded magazine for a full one */
+		if ((mag = kmem_depot_get(&kn->kn_fulldepot, cpu)) != NULL) {
+			cpu->kcc_stats.kcs_depotfull++;
+			if (mag->km_type->mt_rounds != cpu->kcc_magsize) {
+				/* Left over from before a resize */
+				kmem_unlock(&cpu->kcc_lock);
+				kmem_magazine_destroy(cp, kn, mag);
+				cpu = kmem_cpu_cache(cp);
+				kmem_lock(&cpu->kcc_lock);
+				continue;
+			}
 
-			bufs = 0;
-			SLIST_FOREACH(bufctl, &(*cp->kc_hashtab)[i], kb_entry)
-				bufs++;
+			if (cpu->kcc_previous == NULL) {
+				cpu->kcc_previous = cpu->kcc_loaded;
+				cpu->kcc_prevrounds = cpu->kcc_rounds;
+			} else {
+				cpu->kcc_loaded->km_rounds = 0;
+				kmem_depot_put(&kn->kn_emptydepot, cpu->kcc_loaded, cpu);
+			}
 
-			printf("%2u: %u%c", i, bufs, (i + 1) % 8 ? '\t' : '\n');
+			cpu->kcc_loaded = mag;
+			cpu->kcc_rounds = mag->km_rounds;
+			continue;
 		}
+
+		break;
 	}
-}
 
-static unsigned int
-kmem_bufaddr_makehash(void *bufaddr)
-{
-	unsigned long hash;
+	if (done == n) {
+		kmem_unlock(&cpu->kcc_lock);
+		KMEM_RECORD_BULK(KMEM_REC_ALLOC, cp, done, objs);
+		return done;
+	}
+
+	kn = &cp->kc_nodes[cpu->kcc_node];
+	cpu->kcc_stats.kcs_magmiss++;
+	kmem_unlock(&cpu->kcc_lock);
 
-	/* Alignment is the same, so strip it */
-	hash = (unsigned long)bufaddr;
-	while (hash >= KH_NUM)
-		hash = (hash % KH_NUM) ^ (hash / KH_NUM);
+	kmem_cache_magazine_update(cp);
 
-	return hash;
+	done += kmem_alloc_from_slab(cp, kn, flags, n - done, &objs[done]);
+	KMEM_RECORD_BULK(KMEM_REC_ALLOC, cp, done, objs);
+	return done;
 }
 
-static struct kmem_slab *
-kmem_alloc_slab(struct kmem_cache *cp, int flags)
+/*
+ * Take n objects from the slab freelists of a node, allocating new
+ * slabs as needed.  Returns the number of objects taken.
+ */
+static size_t
+kmem_alloc_from_slab(struct kmem_cache *cp, struct kmem_node *kn, int flags,
+		size_t n, void **objs)
 {
-	void *pages;
-	char *bufpos;
-	unsigned int i;
 	struct kmem_slab *slab;
+	size_t done;
+	void *obj;
 
-	cp->kc_cpu[0].kcc_stats.kcs_misses++;		/* XXX curcpu */
-
-	/* Get the memory */
-	pages = kmem_get_pages(cp->kc_pages, flags);
-	if (pages == NULL)
-		return NULL;
+	done = 0;
+	kmem_lock(&kn->kn_slablock);
+	while (done < n) {
+		/* Fullest partial slab first, then an unused one */
+		if (kn->kn_partialmap != 0)
+			slab = TAILQ_FIRST(&kn->kn_slabs[32 -
+			    __builtin_clz(kn->kn_partialmap)]);
+		else
+			slab = TAILQ_FIRST(&kn->kn_slabs[KS_FREE]);
 
-	bufpos = pages + cp->kc_color;
+		/* There is no free slab. Allocate one */
+		if (slab == NULL) {
+			slab = kmem_alloc_slab(cp, kn, flags);
+			if (slab == NULL)
+				break;
+
+			if (cp->kc_ctor != NULL || cp->kc_slabctor != NULL) {
+				kmem_unlock(&kn->kn_slablock);
+				kmem_construct_slab(cp, slab);
+				kmem_lock(&kn->kn_slablock);
+			}
 
-	/* Change coloring for next slab */
-	cp->kc_color += cp->kc_align;
-	if (cp->kc_color > cp->kc_maxcolor);
-		cp->kc_color = 0;
+			/* Others might have added slabs in the meantime */
+			slab->ks_list = KS_FREE;
+			TAILQ_INSERT_TAIL(&kn->kn_slabs[KS_FREE], slab, ks_entry);
+			continue;
+		}
 
-	/*
-	 * If one slab spans multiple pages, we can't inline
-	 * the administrative data and need to allocate it
-	 * separately.
-	 */
-	if (cp->kc_pages > 1) {
-		/* XXX recursion? */
-		slab = kmem_cache_alloc(slab_cch, flags);
-		if (slab == NULL) {
-			kmem_return_pages(pages, cp->kc_pages);
-			return NULL;
+		if (cp->kc_flags & KMC_BITMAP) {
+			done += kmem_bitmap_alloc(cp, slab, n - done, &objs[done]);
+			kmem_slab_requeue(cp, kn, slab);
+			continue;
 		}
 
-		SLIST_INIT(&slab->ks_freebufs);
-		for (i = cp->kc_bufs; i; --i) {
-			struct kmem_bufctl *newbufctl;
+		while (done < n && slab->ks_refcnt < cp->kc_bufs) {
+			if (cp->kc_flags & KMC_HASH) {
+				struct kmem_bufctl *bufctl;
 
-			newbufctl = kmem_cache_alloc(bufctl_cch, flags);
-			if (newbufctl == NULL) {
-				while ((newbufctl = SLIST_FIRST(&slab->ks_freebufs)) != NULL) {
-					kmem_cache_free(bufctl_cch, newbufctl);
+				bufctl = SLIST_FIRST(&slab->ks_freebufs);
+				if (bufctl != NULL) {
 					SLIST_REMOVE_HEAD(&slab->ks_freebufs, kb_entry);
+				} else {
+					/* Carve a new buf */
+					bufctl = kmem_cache_alloc(bufctl_cch, flags);
+					if (bufctl == NULL)
+						break;
+					bufctl->kb_buf = slab->ks_base +
+					    slab->ks_carved++ * cp->kc_realsize;
+					bufctl->kb_slab = slab;
 				}
-				kmem_return_pages(pages, cp->kc_pages);
-				return NULL;
+				obj = bufctl->kb_buf;
+				SLIST_INSERT_HEAD(kmem_bufaddr_makehash(cp, kn, bufctl->kb_buf), bufctl, kb_entry);
+				if (++kn->kn_hashcount > 2 * (kn->kn_hashmask + 1))
+					kmem_hash_rescale(cp, kn, 4 * (kn->kn_hashmask + 1));
+			} else if (!SLIST_EMPTY(&slab->ks_freebufs)) {
+				obj = (char *)SLIST_FIRST(&slab->ks_freebufs) - cp->kc_realsize +
+					sizeof(struct kmem_bufctl_inline);
+				SLIST_REMOVE_HEAD(&slab->ks_freebufs, kb_entry);
+			} else {
+				/* Carve a new buf */
+				obj = slab->ks_base + slab->ks_carved++ * cp->kc_realsize;
 			}
-
-			newbufctl->kb_buf = bufpos;
-			bufpos += cp->kc_realsize;
-			newbufctl->kb_slab = slab;
-			SLIST_INSERT_HEAD(&slab->ks_freebufs, newbufctl, kb_entry);
+			slab->ks_refcnt++;
+			objs[done++] = obj;
 		}
-	}
-	/*
-	 * This cache uses slabs with inlined administative
-	 * information. Probably the hot path.
-	 */
-	else {
-		/*
-		 * Struct kmem_slab resides at the very end of the page
-		 * when administrative data is stored inline.
-		 */
-		slab = pages + PAGESIZ - sizeof(struct kmem_slab);
 
-		/*
-		 * Pre-calc location of the linkage, which is located
-		 * at the far end of each buf (to minimize the possibility
-		 * of being overwritten by use-after-free code).
-		 */
-		bufpos += cp->kc_realsize - sizeof(struct kmem_bufctl_inline);
+		kmem_slab_requeue(cp, kn, slab);
 
-		SLIST_INIT(&slab->ks_freebufs);
-		for (i = cp->kc_bufs; i; --i) {
-			struct kmem_bufctl_inline *newbufctl;
-
-			newbufctl = (struct kmem_bufctl_inline *)bufpos;
-			bufpos += cp->kc_realsize;
-			SLIST_INSERT_HEAD(&slab->ks_freebufs, (struct kmem_bufctl *)newbufctl, kb_entry);
-			/*printf("%p->%p(%p)\n", SLIST_FIRST(&slab->ks_freebufs), SLIST_NEXT(newbufctl, kb_entry), newbufctl);*/
-		}
+		/* Out of bufctls */
+		if (done < n && slab->ks_refcnt < cp->kc_bufs)
+			break;
 	}
+	kn->kn_slaballocs += done;
+	if (kn->kn_slaballocs - kn->kn_slabfrees > kn->kn_maxbufs)
+		kn->kn_maxbufs = kn->kn_slaballocs - kn->kn_slabfrees;
+	kmem_unlock(&kn->kn_slablock);
+	KMEM_PROBE3(slab__alloc, cp, n, done);
 
-	slab->ks_refcnt = 0;
-	slab->ks_page = pages;
-
-	return slab;
+	return done;
 }
 
-void *
-kmem_cache_alloc(struct kmem_cache *cp, int flags)
+static int
+kmem_round_cmp(const void *a, const void *b)
 {
-	struct kmem_slab *slab;
-	struct kmem_cpu_cache *cpu;
-	struct kmem_magazine *mag;
-	void *obj;
+	unsigned long pa, pb;
 
-	cpu = &cp->kc_cpu[0];	/* XXX use cpu number */
-
-	cpu->kcc_stats.kcs_allocs++;
+	pa = (unsigned long)*(void * const *)a;
+	pb = (unsigned long)*(void * const *)b;
+	return (pa > pb) - (pa < pb);
+}
 
-	/*
-	 * If the loaded magazine still has rounds in it,
-	 * take one and return.
-	 */
-	if (cpu->kcc_rounds > 0) {
-		mag = cpu->kcc_loaded;
+/*
+ * Return all rounds of a magazine to their slabs.  Slabs cover
+ * disjoint address ranges, so sorting the rounds by address groups
+ * them by slab, and every slab gets requeued only once.  Going
+ * through the sorted rounds backwards leaves the freelists in
+ * ascending address order.
+ */
+static void
+kmem_empty_magazine(struct kmem_cache *cp, struct kmem_node *kn,
+		struct kmem_magazine *mag)
+{
+	struct kmem_slab *slab, *prevslab;
+	struct kmem_bufctl *bufctl;
 
-alloc_loaded:
-		obj = mag->km_round[--cpu->kcc_rounds];
-		return obj;
+	if (mag->km_rounds == 0)
+		return;
+	KMEM_PROBE2(slab__drain, cp, mag->km_rounds);
+
+	qsort(mag->km_round, mag->km_rounds, sizeof(mag->km_round[0]),
+	    kmem_round_cmp);
+
+	prevslab = NULL;
+	kmem_lock(&kn->kn_slablock);
+	kn->kn_slabfrees += mag->km_rounds;
+	while (mag->km_rounds) {
+		slab = kmem_buf_slab(cp, kn, mag->km_round[--mag->km_rounds],
+		    &bufctl);
+		if (slab != prevslab && prevslab != NULL)
+			kmem_slab_requeue(cp, kn, prevslab);
+		kmem_slab_putbuf(cp, slab, mag->km_round[mag->km_rounds], bufctl);
+		prevslab = slab;
 	}
+	kmem_slab_requeue(cp, kn, prevslab);
+	kmem_unlock(&kn->kn_slablock);
+}
 
-	/*
-	 * The loaded magazine had drained. If there are rounds in
-	 * the previous magazine, swap them and try again.
-	 */
-	if (cpu->kcc_prevrounds > 0) {
-		cpu->kcc_rounds = cpu->kcc_prevrounds;
-		cpu->kcc_prevrounds = 0;
-
-		mag = cpu->kcc_previous;
-		cpu->kcc_previous = cpu->kcc_loaded;
-		cpu->kcc_loaded = mag;
+/*
+ * Give all slabs without allocated buffers back to the page layer.
+ * Those are kept on their own list.  Returns the number of pages
+ * freed.
+ */
+static unsigned int
+kmem_cache_reap_slabs(struct kmem_cache *cp)
+{
+	TAILQ_HEAD(, kmem_slab) freeslabs;
+	struct kmem_slab *slab;
+	struct kmem_node *kn;
+	unsigned int pages;
+	int i;
 
-		goto alloc_loaded;
-	}
+	if (cp->kc_flags & KMC_NOREAP)
+		return 0;
 
-	/*
-	 * Both magazines are empty (or not allocated), so return an
-	 * empty one and load a full one.
-	 */
-	if (!SLIST_EMPTY(&cp->kc_fulldepot)) {
-		/*
-		 * If the previous magazine is not allocated, the loaded
-		 * could also not be allocated. In both cases just put loaded
-		 * into the free previous slot.
-		 * If the previous magazine is allocated, loaded is too.
-		 */
-		if (cpu->kcc_previous == NULL) {
-			cpu->kcc_previous = cpu->kcc_loaded;
-			cpu->kcc_prevrounds = cpu->kcc_rounds;
-		} else {
-			SLIST_INSERT_HEAD(&cp->kc_emptydepot, cpu->kcc_loaded, km_entry);
-		}
+	pages = 0;
+	for (i = 0; i < kmem_nnodes; i++) {
+		kn = &cp->kc_nodes[i];
 
-		mag = cpu->kcc_loaded = SLIST_FIRST(&cp->kc_fulldepot);
-		SLIST_REMOVE_HEAD(&cp->kc_fulldepot, km_entry);
-		cpu->kcc_rounds = mag->km_rounds;
+		TAILQ_INIT(&freeslabs);
+		kmem_lock(&kn->kn_slablock);
+		TAILQ_CONCAT(&freeslabs, &kn->kn_slabs[KS_FREE], ks_entry);
+		kmem_unlock(&kn->kn_slablock);
 
-		goto alloc_loaded;
+		while ((slab = TAILQ_FIRST(&freeslabs)) != NULL) {
+			TAILQ_REMOVE(&freeslabs, slab, ks_entry);
+			kmem_free_slab(cp, kn, slab);
+			pages += cp->kc_pages;
+		}
 	}
 
-	cpu->kcc_stats.kcs_magmiss++;
+	return pages;
+}
 
-	slab = cp->kc_freeslab;
+static void
+kmem_free_slab(struct kmem_cache *cp, struct kmem_node *kn,
+		struct kmem_slab *slab)
+{
+	unsigned int i;
+	void *page;
 
-	/* There is no free slab. Allocate one */
-	if (slab == NULL) {
-		slab = kmem_alloc_slab(cp, flags);
-		if (slab == NULL)
-			return NULL;
+	page = slab->ks_page;
+	KMEM_PROBE2(slab__destroy, cp, slab);
 
-		TAILQ_INSERT_TAIL(&cp->kc_slabs, slab, ks_entry);
-		if (cp->kc_freeslab == NULL)
-			cp->kc_freeslab = slab;
+	/* All bufs are free, and constructed if there is a destructor */
+	if (cp->kc_dtor != NULL) {
+		for (i = 0; i < cp->kc_bufs; i++)
+			cp->kc_dtor(slab->ks_base + i * cp->kc_realsize, cp->kc_size);
 	}
 
-	if (cp->kc_pages > 1) {
+	if (cp->kc_flags & KMC_HASH) {
 		struct kmem_bufctl *bufctl;
 
-		bufctl = SLIST_FIRST(&slab->ks_freebufs);
-		obj = bufctl->kb_buf;
-		SLIST_REMOVE_HEAD(&slab->ks_freebufs, kb_entry);
-		SLIST_INSERT_HEAD(&(*cp->kc_hashtab)[kmem_bufaddr_makehash(bufctl->kb_buf)], bufctl, kb_entry);
-	} else {
-		obj = (char *)SLIST_FIRST(&slab->ks_freebufs) - cp->kc_realsize +
-			sizeof(struct kmem_bufctl_inline);
-		SLIST_REMOVE_HEAD(&slab->ks_freebufs, kb_entry);
-	}
+		while ((bufctl = SLIST_FIRST(&slab->ks_freebufs)) != NULL) {
+			SLIST_REMOVE_HEAD(&slab->ks_freebufs, kb_entry);
+			kmem_cache_free(bufctl_cch, bufctl);
+		}
 
-	if (SLIST_EMPTY(&slab->ks_freebufs)) {
-		/*
-		 * We drained this slab, so move it to the right
-		 * position.
-		 */
-		cp->kc_freeslab = TAILQ_NEXT(slab, ks_entry);
-		TAILQ_REMOVE(&cp->kc_slabs, slab, ks_entry);
-		TAILQ_INSERT_HEAD(&cp->kc_slabs, slab, ks_entry);
+		kmem_cache_free(slab_cch, slab);
 	}
-	slab->ks_refcnt++;
 
-	/* Construct the object, if needed. */
-	if (cp->kc_ctor != NULL)
-		cp->kc_ctor(obj, cp->kc_size);
+	vmem_setowner(page, cp->kc_pages, NULL);
+	__sync_fetch_and_add(&kn->kn_slabdestroys, 1);
+	__sync_fetch_and_sub(&kn->kn_pages, cp->kc_pages);
+	kmem_return_pages(kn->kn_arena, page, cp->kc_pages);
+}
 
-	return obj;
+static void
+kmem_magazine_destroy(struct kmem_cache *cp, struct kmem_node *kn,
+		struct kmem_magazine *mag)
+{
+	kmem_empty_magazine(cp, kn, mag);
+	kmem_cache_free(mag->km_type->mt_cache, mag);
 }
 
+/*
+ * Put a buf back on its slab, which is on the slab list of kn.  Called
+ * with the node's slab lock held.
+ */
 static void
-kmem_empty_magazine(struct kmem_cache *cp, struct kmem_magazine *mag)
+kmem_returnto_slab(struct kmem_cache *cp, struct kmem_node *kn, void *obj)
 {
-	while (mag->km_rounds)
-		kmem_returnto_slab(cp, mag->km_round[--mag->km_rounds]);
+	struct kmem_slab *slab;
+	struct kmem_bufctl *bufctl;
+
+	slab = kmem_buf_slab(cp, kn, obj, &bufctl);
+	kmem_slab_putbuf(cp, slab, obj, bufctl);
+	kn->kn_slabfrees++;
+
+	kmem_slab_requeue(cp, kn, slab);
 }
 
+/*
+ * Mark a buf free in its slab, on the free map or the freelist.
+ * Called with the node's slab lock held.
+ */
 static void
-kmem_returnto_slab(struct kmem_cache *cp, void *obj)
+kmem_slab_putbuf(struct kmem_cache *cp, struct kmem_slab *slab, void *obj,
+		struct kmem_bufctl *bufctl)
+{
+	unsigned int idx, w;
+
+	if (cp->kc_flags & KMC_BITMAP) {
+		idx = ((char *)obj - slab->ks_base) / cp->kc_realsize;
+		w = idx / KS_MAPBITS;
+		KKASSERT((!(slab->ks_freemap[w] & (1UL << (idx % KS_MAPBITS)))));
+		slab->ks_freemap[w] |= 1UL << (idx % KS_MAPBITS);
+		if (w < slab->ks_maphint)
+			slab->ks_maphint = w;
+	} else {
+		SLIST_INSERT_HEAD(&slab->ks_freebufs, bufctl, kb_entry);
+	}
+	slab->ks_refcnt--;
+}
+
+/*
+ * Take up to n bufs off the free map of a slab, a whole map word at
+ * a time, lowest address first.  The bufs themselves aren't touched.
+ * Called with the node's slab lock held.
+ */
+static size_t
+kmem_bitmap_alloc(struct kmem_cache *cp, struct kmem_slab *slab, size_t n,
+		void **objs)
+{
+	unsigned long word;
+	unsigned int w, nwords;
+	size_t done;
+
+	nwords = howmany(cp->kc_bufs, KS_MAPBITS);
+	done = 0;
+	w = slab->ks_maphint;
+	while (done < n && w < nwords) {
+		word = slab->ks_freemap[w];
+		while (word != 0 && done < n) {
+			objs[done++] = slab->ks_base + (w * KS_MAPBITS +
+			    __builtin_ctzl(word)) * cp->kc_realsize;
+			word &= word - 1;
+		}
+		slab->ks_freemap[w] = word;
+		if (word == 0)
+			w++;
+	}
+	slab->ks_maphint = w;
+	slab->ks_refcnt += done;
+
+	return done;
+}
+
+/*
+ * Find the slab and bufctl of an allocated buf.  The bufctl of a
+ * hashed cache is taken out of the hash table.  Called with the
+ * node's slab lock held.
+ */
+static struct kmem_slab *
+kmem_buf_slab(struct kmem_cache *cp, struct kmem_node *kn, void *obj,
+		struct kmem_bufctl **bufctlp)
 {
-	struct kmem_slab *slab, *nextslab;
+	struct kmem_slab *slab;
 	struct kmem_bufctl *bufctl;
 
-	if (cp->kc_pages > 1) {
+	if (cp->kc_flags & KMC_HASH) {
 		kmem_hashentry *hashhead;
 		struct kmem_bufctl *obufctl;
 
-		hashhead = &(*cp->kc_hashtab)[kmem_bufaddr_makehash(obj)];
+		hashhead = kmem_bufaddr_makehash(cp, kn, obj);
 		obufctl = NULL;
 		bufctl = SLIST_FIRST(hashhead);
 		while (bufctl != NULL && bufctl->kb_buf != obj) {
@@ -633,39 +3145,53 @@ kmem_returnto_slab(struct kmem_cache *cp, void *obj)
 		KKASSERT((bufctl != NULL));
 
 		SLIST_REMOVE_AFTER(hashhead, obufctl, kb_entry);
+		kn->kn_hashcount--;
 
 		slab = bufctl->kb_slab;
 	} else {
-		slab = (struct kmem_slab *)(((unsigned long)obj & ~(PAGESIZ - 1))
-			+ PAGESIZ - sizeof(struct kmem_slab));
+		unsigned long slabsize;
+
+		slabsize = cp->kc_pages * PAGESIZ;
+		slab = (struct kmem_slab *)(((unsigned long)obj & ~(slabsize - 1))
+			+ slabsize - cp->kc_slabhdr);
 		bufctl = obj + cp->kc_realsize - sizeof(struct kmem_bufctl_inline);
 	}
 
-	SLIST_INSERT_HEAD(&slab->ks_freebufs, bufctl, kb_entry);
-	slab->ks_refcnt--;
+	*bufctlp = bufctl;
+	return slab;
+}
 
-	nextslab = TAILQ_NEXT(slab, ks_entry);
-	if (slab->ks_refcnt == 0 && nextslab && nextslab->ks_refcnt > 0) {
-		/*
-		 * If the slab is full again and isn't already at the
-		 * end of the queue, then move it there.
-		 */
-		TAILQ_REMOVE(&cp->kc_slabs, slab, ks_entry);
-		TAILQ_INSERT_TAIL(&cp->kc_slabs, slab, ks_entry);
-	} else if (slab->ks_refcnt + 1 == cp->kc_bufs) {
-		/*
-		 * If the slab used to be empty, we need to
-		 * move it to the "partly full" area.
-		 */
-		TAILQ_REMOVE(&cp->kc_slabs, slab, ks_entry);
-		if (cp->kc_freeslab != NULL)
-			TAILQ_INSERT_AFTER(&cp->kc_slabs, cp->kc_freeslab, slab, ks_entry);
-		else
-			TAILQ_INSERT_TAIL(&cp->kc_slabs, slab, ks_entry);
-	}
+/*
+ * Move a slab to the list matching its occupancy, after bufs were
+ * taken from or returned to it.  Called with the node's slab lock
+ * held.
+ */
+static void
+kmem_slab_requeue(struct kmem_cache *cp, struct kmem_node *kn,
+		struct kmem_slab *slab)
+{
+	unsigned int list;
+
+	if (slab->ks_refcnt == 0)
+		list = KS_FREE;
+	else if (slab->ks_refcnt == cp->kc_bufs)
+		list = KS_USED;
+	else
+		list = 1 + slab->ks_refcnt * KS_NPARTIAL / cp->kc_bufs;
+
+	if (list == slab->ks_list)
+		return;
 
-	if (cp->kc_freeslab == NULL)
-		cp->kc_freeslab = slab;
+	TAILQ_REMOVE(&kn->kn_slabs[slab->ks_list], slab, ks_entry);
+	if (slab->ks_list != KS_FREE && slab->ks_list != KS_USED &&
+	    TAILQ_EMPTY(&kn->kn_slabs[slab->ks_list]))
+		kn->kn_partialmap &= ~(1U << (slab->ks_list - 1));
+
+	/* Recently used slabs first, their bufs are more likely cached */
+	TAILQ_INSERT_HEAD(&kn->kn_slabs[list], slab, ks_entry);
+	if (list != KS_FREE && list != KS_USED)
+		kn->kn_partialmap |= 1U << (list - 1);
+	slab->ks_list = list;
 }
 
 void
@@ -673,8 +3199,30 @@ kmem_cache_free(struct kmem_cache *cp, void *obj)
 {
 	struct kmem_cpu_cache *cpu;
 	struct kmem_magazine *mag;
-
-	cpu = &cp->kc_cpu[0];	/* XXX use cpu number */
+	struct kmem_magtype *mt;
+	struct kmem_node *kn;
+	int node;
+	KMEM_LAT_DECL;
+
+	KMEM_LAT_BEGIN(KMEM_LAT_FREE_MAG);
+	KMEM_RECORD_OP(KMEM_REC_FREE, cp, obj);
+	node = 0;
+	if (kmem_nnodes > 1) {
+		node = vmem_node(obj);
+		KKASSERT((node >= 0));
+	}
+	kn = &cp->kc_nodes[node];
+
+retry:
+	cpu = kmem_cpu_cache(cp);
+	if (node != cpu->kcc_node) {
+		KMEM_PROBE3(free__remote, cp, obj, node);
+		KMEM_LAT_PATH(KMEM_LAT_FREE_REMOTE);
+		kmem_cache_free_remote(cp, node, obj);
+		KMEM_LAT_END(cpu);
+		return;
+	}
+	kmem_lock(&cpu->kcc_lock);
 
 	/*
 	 * If there is still space in the loaded magazine,
@@ -687,6 +3235,10 @@ kmem_cache_free(struct kmem_cache *cp, void *obj)
 
 free_loaded:
 		mag->km_round[cpu->kcc_rounds++] = obj;
+		cpu->kcc_stats.kcs_frees++;
+		kmem_unlock(&cpu->kcc_lock);
+		KMEM_PROBE2(free__loaded, cp, obj);
+		KMEM_LAT_END(cpu);
 		return;
 	}
 
@@ -702,6 +3254,7 @@ free_loaded:
 		cpu->kcc_previous = cpu->kcc_loaded;
 		cpu->kcc_loaded = mag;
 
+		KMEM_PROBE1(free__previous, cp);
 		goto free_loaded;
 	}
 
@@ -709,8 +3262,17 @@ free_loaded:
 	 * Both magazines are either full or not allocated. Try to
 	 * fetch an empty one from the depot.
 	 */
-	if (!SLIST_EMPTY(&cp->kc_emptydepot)) {
-free_depot:
+	KMEM_LAT_PATH(KMEM_LAT_FREE_DEPOT);
+	if ((mag = kmem_depot_get(&kn->kn_emptydepot, cpu)) != NULL) {
+		cpu->kcc_stats.kcs_depotempty++;
+		KMEM_PROBE2(free__depot, cp, mag);
+		if (mag->km_type->mt_rounds != cpu->kcc_magsize) {
+			/* Left over from before a resize */
+			kmem_unlock(&cpu->kcc_lock);
+			kmem_magazine_destroy(cp, kn, mag);
+			goto retry;
+		}
+
 		/*
 		 * If the previous magazine is not allocated, the loaded
 		 * could also not be allocated. In both cases just put loaded
@@ -722,28 +3284,257 @@ free_depot:
 			cpu->kcc_prevrounds = cpu->kcc_rounds;
 		} else {
 			cpu->kcc_loaded->km_rounds = cpu->kcc_rounds;
-			SLIST_INSERT_HEAD(&cp->kc_fulldepot, cpu->kcc_loaded, km_entry);
+			kmem_depot_put(&kn->kn_fulldepot, cpu->kcc_loaded, cpu);
 		}
 
-		mag = cpu->kcc_loaded = SLIST_FIRST(&cp->kc_emptydepot);
-		SLIST_REMOVE_HEAD(&cp->kc_emptydepot, km_entry);
+		cpu->kcc_loaded = mag;
 		cpu->kcc_rounds = 0;
 
 		goto free_loaded;
 	}
 
 	cpu->kcc_stats.kcs_magmiss++;
+	kmem_unlock(&cpu->kcc_lock);
+	KMEM_PROBE1(free__miss, cp);
+	KMEM_LAT_PATH(KMEM_LAT_FREE_SLAB);
+
+	kmem_cache_magazine_update(cp);
 
 	/*
 	 * Try to allocate a new empty magazine. If possible, add it
-	 * to the depot and start over.
+	 * to the depot and start over.  The CPU lock can't be held
+	 * here, as the magazine might come from this very cache.
 	 */
-	mag = kmem_cache_alloc(mag_cch, 0);	/* XXX flags */
+	mt = cp->kc_magtype;
+	mag = kmem_cache_alloc(mt->mt_cache, 0);	/* XXX flags */
+	if (mag != NULL) {
+		mag->km_type = mt;
+		mag->km_rounds = 0;
+		kmem_depot_put(&kn->kn_emptydepot, mag, NULL);
+
+		goto retry;
+	}
+
+	kmem_lock(&kn->kn_slablock);
+	kmem_returnto_slab(cp, kn, obj);
+	kn->kn_directfrees++;
+	kmem_unlock(&kn->kn_slablock);
+	KMEM_PROBE2(free__slab, cp, obj);
+	KMEM_LAT_END(cpu);
+}
+
+/*
+ * Free a buf of another node than the one of the current CPU.  It is
+ * collected in the CPU's alien magazine for that node, and full alien
+ * magazines go to the full depot of the node, where the node's own
+ * CPUs pick them up again.  So the bufs return home in batches, and
+ * the per-CPU magazines only ever hold local memory.
+ */
+static void
+kmem_cache_free_remote(struct kmem_cache *cp, int node, void *obj)
+{
+	struct kmem_cpu_cache *cpu;
+	struct kmem_magazine *mag;
+	struct kmem_magtype *mt;
+	struct kmem_node *kn;
+
+	kn = &cp->kc_nodes[node];
+
+retry:
+	cpu = kmem_cpu_cache(cp);
+	kmem_lock(&cpu->kcc_lock);
+
+	mag = cpu->kcc_alien[node];
+	if (mag != NULL && mag->km_rounds < mag->km_type->mt_rounds) {
+free_alien:
+		mag->km_round[mag->km_rounds++] = obj;
+		cpu->kcc_stats.kcs_frees++;
+		cpu->kcc_stats.kcs_remotefree++;
+		kmem_unlock(&cpu->kcc_lock);
+		return;
+	}
+
+	/* Send the full one home and start a new one */
+	if (mag != NULL) {
+		cpu->kcc_alien[node] = NULL;
+		kmem_depot_put(&kn->kn_fulldepot, mag, cpu);
+	}
+
+	if ((mag = kmem_depot_get(&kn->kn_emptydepot, cpu)) != NULL) {
+		cpu->kcc_stats.kcs_depotempty++;
+		if (mag->km_type->mt_rounds != cpu->kcc_magsize) {
+			/* Left over from before a resize */
+			kmem_unlock(&cpu->kcc_lock);
+			kmem_magazine_destroy(cp, kn, mag);
+			goto retry;
+		}
+
+		cpu->kcc_alien[node] = mag;
+		goto free_alien;
+	}
+
+	kmem_unlock(&cpu->kcc_lock);
+
+	mt = cp->kc_magtype;
+	mag = kmem_cache_alloc(mt->mt_cache, 0);	/* XXX flags */
+	if (mag != NULL) {
+		mag->km_type = mt;
+		mag->km_rounds = 0;
+		kmem_depot_put(&kn->kn_emptydepot, mag, NULL);
+
+		goto retry;
+	}
+
+	kmem_lock(&kn->kn_slablock);
+	kmem_returnto_slab(cp, kn, obj);
+	kn->kn_directfrees++;
+	kmem_unlock(&kn->kn_slablock);
+	KMEM_PROBE2(free__slab, cp, obj);
+}
+
+/*
+ * Free the n objects in objs.  Runs of objects are put into the
+ * magazines at once; full magazines are exchanged for empty ones
+ * from the depot.  The contents of objs are clobbered.
+ */
+void
+kmem_cache_free_bulk(struct kmem_cache *cp, size_t n, void **objs)
+{
+	struct kmem_cpu_cache *cpu;
+	struct kmem_magazine *mag;
+	struct kmem_magtype *mt;
+	struct kmem_node *kn;
+	size_t cnt, i;
+	int node;
+
+	KMEM_RECORD_BULK(KMEM_REC_FREE, cp, n, objs);
+
+retry:
+	cpu = kmem_cpu_cache(cp);
+	kn = &cp->kc_nodes[cpu->kcc_node];
+	if (kmem_nnodes > 1) {
+		/* Keep the local bufs at the front, send the rest home */
+		for (i = cnt = 0; i < n; i++) {
+			node = vmem_node(objs[i]);
+			KKASSERT((node >= 0));
+			if (node != cpu->kcc_node)
+				kmem_cache_free_remote(cp, node, objs[i]);
+			else
+				objs[cnt++] = objs[i];
+		}
+		n = cnt;
+	}
+	kmem_lock(&cpu->kcc_lock);
+
+	while (n > 0) {
+		/* Fill up the loaded magazine */
+		if ((unsigned)cpu->kcc_rounds < (unsigned)cpu->kcc_magsize) {
+			cnt = MIN(n, (size_t)(cpu->kcc_magsize - cpu->kcc_rounds));
+			n -= cnt;
+			memcpy(&cpu->kcc_loaded->km_round[cpu->kcc_rounds], &objs[n],
+			    cnt * sizeof(*objs));
+			cpu->kcc_rounds += cnt;
+			cpu->kcc_stats.kcs_frees += cnt;
+			continue;
+		}
+
+		/* Swap in the previous one if it is empty */
+		if (cpu->kcc_prevrounds == 0) {
+			cpu->kcc_prevrounds = cpu->kcc_rounds;
+			cpu->kcc_rounds = 0;
+
+			mag = cpu->kcc_previous;
+			cpu->kcc_previous = cpu->kcc_loaded;
+			cpu->kcc_loaded = mag;
+			continue;
+		}
+
+		/* Exchange the full loaded magazine for an empty one */
+		if ((mag = kmem_depot_get(&kn->kn_emptydepot, cpu)) != NULL) {
+			cpu->kcc_stats.kcs_depotempty++;
+			if (mag->km_type->mt_rounds != cpu->kcc_magsize) {
+				/* Left over from before a resize */
+				kmem_unlock(&cpu->kcc_lock);
+				kmem_magazine_destroy(cp, kn, mag);
+				goto retry;
+			}
+
+			if (cpu->kcc_previous == NULL) {
+				cpu->kcc_previous = cpu->kcc_loaded;
+				cpu->kcc_prevrounds = cpu->kcc_rounds;
+			} else {
+				cpu->kcc_loaded->km_rounds = cpu->kcc_rounds;
+				kmem_depot_put(&kn->kn_fulldepot, cpu->kcc_loaded, cpu);
+			}
+
+			cpu->kcc_loaded = mag;
+			cpu->kcc_rounds = 0;
+			continue;
+		}
+
+		break;
+	}
+
+	if (n == 0) {
+		kmem_unlock(&cpu->kcc_lock);
+		return;
+	}
+
+	cpu->kcc_stats.kcs_magmiss++;
+	kmem_unlock(&cpu->kcc_lock);
+
+	kmem_cache_magazine_update(cp);
+
+	/* Same as kmem_cache_free(), get a new empty magazine */
+	mt = cp->kc_magtype;
+	mag = kmem_cache_alloc(mt->mt_cache, 0);	/* XXX flags */
 	if (mag != NULL) {
-		SLIST_INSERT_HEAD(&cp->kc_emptydepot, mag, km_entry);
+		mag->km_type = mt;
+		mag->km_rounds = 0;
+		kmem_depot_put(&kn->kn_emptydepot, mag, NULL);
+
+		goto retry;
+	}
+
+	kmem_lock(&kn->kn_slablock);
+	kn->kn_directfrees += n;
+	while (n > 0)
+		kmem_returnto_slab(cp, kn, objs[--n]);
+	kmem_unlock(&kn->kn_slablock);
+}
+
+/*
+ * Allocate size bytes.  Small sizes come from the size class caches,
+ * larger ones straight from the page layer, on the current CPU's node.
+ * The size has to be passed to kmem_free() again.
+ */
+void *
+kmem_alloc(size_t size, int flags)
+{
+	if (size == 0)
+		return NULL;
+	if (size <= KMEM_MAXBUF)
+		return kmem_cache_alloc(kmem_alloc_table[(size - 1) >>
+		    KMEM_ALIGN_SHIFT], flags);
+	if (size > SIZE_MAX - PAGESIZ + 1)	/* Page count would wrap */
+		return NULL;
+
+	return kmem_get_pages(kmem_arenas[kmem_curnode()], howmany(size, PAGESIZ),
+	    flags);
+}
 
-		goto free_depot;
+void
+kmem_free(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return;
+	if (size <= KMEM_MAXBUF) {
+		KKASSERT((size != 0));
+		kmem_cache_free(kmem_alloc_table[(size - 1) >> KMEM_ALIGN_SHIFT],
+		    ptr);
+		return;
 	}
 
-	kmem_returnto_slab(cp, obj);
+	kmem_return_pages(kmem_arenas[kmem_nnodes > 1 ? vmem_node(ptr) : 0],
+	    ptr, howmany(size, PAGESIZ));
 }
@@ -37,22 +37,164 @@
 #ifndef ALLOC_H
 #define	ALLIC_H
 
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Cache statistics, as summed up by kmem_cache_getstats().  The
+ * version changes whenever the layout does.
+ */
+#define	KMEM_STATS_VERSION	2
+
 struct kmem_cache_stats {
-	unsigned int	kcs_allocs;		/* Total allocs */
-	unsigned int	kcs_magmiss;		/* Magazine misses */
-	unsigned int	kcs_misses;		/* Cache misses */
+	unsigned int	kcs_version;		/* KMEM_STATS_VERSION */
+	unsigned int	kcs_bufsize;		/* Object size */
+
+	/* Magazine layer */
+	uint64_t	kcs_allocs;		/* Total allocs */
+	uint64_t	kcs_frees;		/* Total frees */
+	uint64_t	kcs_magmiss;		/* Magazine misses */
+	uint64_t	kcs_refills;		/* Magazines filled from slabs */
+	uint64_t	kcs_remotefree;		/* Frees of other nodes' bufs */
+
+	/* Depot layer */
+	uint64_t	kcs_depotfull;		/* Full magazines handed out */
+	uint64_t	kcs_depotempty;		/* Empty magazines handed out */
+	uint64_t	kcs_depotcontention;	/* Contended depot accesses */
+
+	/* Slab layer */
+	uint64_t	kcs_misses;		/* Bufs allocated from slabs */
+	uint64_t	kcs_slabfrees;		/* Bufs returned to slabs */
+	uint64_t	kcs_slabcreates;	/* Slabs created */
+	uint64_t	kcs_slabdestroys;	/* Slabs given back */
+
+	/* Page layer */
+	uint64_t	kcs_pages;		/* Pages held by slabs */
+	uint64_t	kcs_maxpages;		/* Sum of per-node high-water marks */
+	uint64_t	kcs_bytes;		/* Bytes allocated, not yet freed */
+	uint64_t	kcs_maxbytes;		/* Same for bytes taken from slabs */
+};
+
+/*
+ * Sampled alloc and free latencies, by the deepest layer the operation
+ * went to, as returned by kmem_cache_getlatency().  Only collected if
+ * the allocator was built with KMEM_LATENCY.
+ */
+#define	KMEM_LATENCY_VERSION	1
+
+#define	KMEM_LAT_ALLOC_MAG	0	/* Alloc from the CPU's magazines */
+#define	KMEM_LAT_ALLOC_DEPOT	1	/* Alloc through the full depot */
+#define	KMEM_LAT_ALLOC_SLAB	2	/* Alloc from the slab layer */
+#define	KMEM_LAT_FREE_MAG	3	/* Free into the CPU's magazines */
+#define	KMEM_LAT_FREE_DEPOT	4	/* Free through the empty depot */
+#define	KMEM_LAT_FREE_SLAB	5	/* Free needing a new magazine or slab */
+#define	KMEM_LAT_FREE_REMOTE	6	/* Free of another node's buf */
+#define	KMEM_LAT_NPATHS		7
+#define	KMEM_LAT_NBUCKETS	32	/* Bucket i counts [2^i, 2^(i+1)) ticks */
+
+struct kmem_cache_latency {
+	unsigned int	kcl_version;		/* KMEM_LATENCY_VERSION */
+	unsigned int	kcl_sample;		/* One in kcl_sample ops timed */
+	int		kcl_tsc;		/* Ticks are TSC cycles, else ns */
+	uint64_t	kcl_count[KMEM_LAT_NPATHS];	/* Samples */
+	uint64_t	kcl_ticks[KMEM_LAT_NPATHS];	/* Sum of samples */
+	uint64_t	kcl_hist[KMEM_LAT_NPATHS][KMEM_LAT_NBUCKETS];
+};
+
+/*
+ * Allocation trace, written by an allocator built with KMEM_RECORD
+ * between kmem_record_start() and kmem_record_stop().  The header is
+ * followed by fixed size records in the order the operations took
+ * place, so a trace can be replayed straight out of a mapping.  Only
+ * caches made with kmem_cache_create() are traced, which includes
+ * the kmem_alloc() size classes.
+ */
+#define	KMEM_RECORD_MAGIC	0x4b4d5452	/* "KMTR" */
+#define	KMEM_RECORD_VERSION	1
+
+struct kmem_record_header {
+	uint32_t	krh_magic;		/* KMEM_RECORD_MAGIC */
+	uint32_t	krh_version;		/* KMEM_RECORD_VERSION */
+	uint32_t	krh_recsize;		/* sizeof(struct kmem_record) */
+	uint32_t	krh_pad;
+};
+
+#define	KMEM_REC_CREATE		1	/* Cache created */
+#define	KMEM_REC_DESTROY	2	/* Cache destroyed */
+#define	KMEM_REC_ALLOC		3	/* Object allocated */
+#define	KMEM_REC_FREE		4	/* Object freed */
+
+struct kmem_record {
+	uint64_t	kr_time;		/* ns since recording started */
+	uint64_t	kr_obj;			/* Object, or alignment if CREATE */
+	uint32_t	kr_cache;		/* Cache ID, from 1 */
+	uint32_t	kr_size;		/* Object size of the cache */
+	uint32_t	kr_thread;		/* Thread ID, from 1 */
+	uint32_t	kr_op;			/* KMEM_REC_* */
 };
 
 struct kmem_cache;
 typedef void (kmem_cache_cdtor)(void *, size_t);
+typedef void (kmem_cache_slabctor)(void *, unsigned int, size_t);
+
+/* Optional cache attributes, set up by kmem_cache_attr_init() */
+struct kmem_cache_attr {
+	int		kca_flags;		/* KMCA_* flags */
+	kmem_cache_slabctor *kca_slabctor;	/* Constructs all bufs of a slab */
+	unsigned int	kca_colorstep;		/* Color step, 0 for a cache line */
+	unsigned int	kca_maxcolor;		/* Largest color, 0 for all slack */
+};
+
+#define	KMCA_HUGEPAGE	0x0001		/* Back slabs with huge pages */
+#define	KMCA_NOCOLOR	0x0002		/* Start all slabs at offset 0 */
+#define	KMCA_COLORRANDOM 0x0004		/* Random instead of sequential colors */
+#define	KMCA_BITMAP	0x0008		/* Track free bufs in a bitmap */
+
+/* Formats of kmem_dump() */
+#define	KMEM_DUMP_TEXT	0		/* One line per cache, like slabinfo */
+#define	KMEM_DUMP_JSON	1
+#define	KMEM_DUMP_VERSION 1		/* Changes with the fields dumped */
+
+#define	KMEM_MAXBUF	16384		/* Largest kmem_alloc() size class */
+
+struct vmem;
+
+extern int kmem_slab_aligned;		/* Inline multi-page slab headers */
+extern struct vmem *kmem_arena;		/* Page arena of node 0 */
+extern struct vmem *kmem_hugearena;	/* Node 0 huge page arena, if used */
 
 void kmem_init(void);
+void kmem_thread_setcpu(int);
 struct kmem_cache *kmem_cache_create(const char *, size_t, unsigned int,
 		kmem_cache_cdtor *, kmem_cache_cdtor *);
+void kmem_cache_attr_init(struct kmem_cache_attr *);
+struct kmem_cache *kmem_cache_create_attr(const char *, size_t, unsigned int,
+		kmem_cache_cdtor *, kmem_cache_cdtor *,
+		const struct kmem_cache_attr *);
 void kmem_cache_destroy(struct kmem_cache *);
 void kmem_cache_debug(struct kmem_cache *);
 void kmem_cache_getstats(struct kmem_cache *, struct kmem_cache_stats *);
+int kmem_cache_getlatency(struct kmem_cache *, struct kmem_cache_latency *);
+void kmem_cache_reap(struct kmem_cache *);
+int kmem_maint_start(unsigned int);
+void kmem_maint_stop(void);
+void kmem_maint_dump(const char *, int);
+int kmem_dump(FILE *, int);
+int kmem_record_start(const char *);
+void kmem_record_stop(void);
+size_t kmem_reclaim(size_t);
+void kmem_fork_prepare(void);
+void kmem_fork_parent(void);
+void kmem_fork_child(void);
+void kmem_cache_applyall(void (*)(struct kmem_cache *, void *), void *);
+const char *kmem_cache_name(struct kmem_cache *);
+size_t kmem_cache_bufsize(struct kmem_cache *);
+struct kmem_cache *kmem_cache_lookup(void *);
 void *kmem_cache_alloc(struct kmem_cache *, int);
 void kmem_cache_free(struct kmem_cache *, void *);
+size_t kmem_cache_alloc_bulk(struct kmem_cache *, int, size_t, void **);
+void kmem_cache_free_bulk(struct kmem_cache *, size_t, void **);
+void *kmem_alloc(size_t, int);
+void kmem_free(void *, size_t);
 
 #endif
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Run kmembench against the system malloc, libkmalloc and whatever
+# other malloc replacements are installed, for each pattern.
+#
+#	compare.sh [kmembench options]
+#
+# KMEMBENCH names the benchmark binary if it isn't next to this
+# script or in the current directory, KMALLOC the libkmalloc to use,
+# and PATTERNS the patterns to run.
+
+dir=$(dirname "$0")
+patterns=${PATTERNS:-"local xfree burst mixed"}
+kmalloc=${KMALLOC:-}
+
+bench=${KMEMBENCH:-}
+if [ -z "$bench" ]; then
+	for b in "$dir/kmembench" ./kmembench; do
+		if [ -x "$b" ]; then
+			bench=$b
+			break
+		fi
+	done
+fi
+if [ -z "$bench" ]; then
+	echo "compare.sh: no kmembench binary, set KMEMBENCH" >&2
+	exit 1
+fi
+
+if [ -z "$kmalloc" ]; then
+	for l in "$dir/../libkmalloc/libkmalloc.so.1" \
+	    "$dir/../libkmalloc/obj/libkmalloc.so.1" \
+	    /usr/lib/libkmalloc.so.1 /usr/local/lib/libkmalloc.so.1; do
+		if [ -f "$l" ]; then
+			kmalloc=$l
+			break
+		fi
+	done
+fi
+
+# First match of each allocator
+libs=
+for name in jemalloc tcmalloc tcmalloc_minimal mimalloc hoard; do
+	for d in /usr/local/lib /usr/lib /usr/lib64 /lib \
+	    /usr/lib/x86_64-linux-gnu /usr/lib/aarch64-linux-gnu; do
+		l=$(ls "$d"/lib$name.so* 2>/dev/null | head -n 1)
+		if [ -n "$l" ]; then
+			libs="$libs $l"
+			break
+		fi
+	done
+done
+
+for p in $patterns; do
+	"$bench" -p "$p" "$@" || exit 1
+	echo
+	for l in $kmalloc $libs; do
+		LD_PRELOAD=$l "$bench" -p "$p" "$@" || exit 1
+		echo
+	done
+done
@@ -0,0 +1,649 @@
+/*
+ * This code is derived from software contributed to The DragonFly Project
+ * by Simon Schubert <corecode@fs.ei.tum.de>.
+ *
+ * Copyright (c) 2004 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Multi-threaded malloc(3) benchmark.  It only calls malloc() and
+ * free(), so the allocator under test is picked with LD_PRELOAD,
+ * e.g. libkmalloc for the slab allocator; compare.sh runs it against
+ * every allocator it can find.
+ *
+ * Each thread runs one of these patterns:
+ *
+ *	local	random allocs and frees on a per-thread set of slots
+ *	xfree	pairs of threads, one allocating, the other freeing
+ *	burst	allocate a batch, then free all of it
+ *	mixed	long-lived objects, replaced now and then, while
+ *		short-lived ones are churned through a small window
+ *
+ * Sizes are either fixed or uniformly random in a range.  For each
+ * thread count, the throughput of all threads together, the speedup
+ * against the first count and the latency percentiles of allocs and
+ * frees are printed.  One in -i operations is timed, with the TSC
+ * where there is one.
+ */
+
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __aligned
+#define	__aligned(x)	__attribute__((__aligned__(x)))
+#endif
+
+#define	CACHE_LINE_SIZE	64
+#define	NELEM(a)	(sizeof(a) / sizeof((a)[0]))
+#define	MAXTHREADS	256
+
+/*
+ * Latency histogram: values below 2^HIST_SUBBITS have their own
+ * bucket, above that each power of two is split in 2^HIST_SUBBITS
+ * buckets, so percentiles are off by at most 1/16.
+ */
+#define	HIST_SUBBITS	4
+#define	HIST_SUB	(1 << HIST_SUBBITS)
+#define	HIST_NBUCKETS	(HIST_SUB + (64 - HIST_SUBBITS) * HIST_SUB)
+
+#define	RING_SIZE	4096		/* Objects in flight per xfree pair */
+
+enum { OP_ALLOC, OP_FREE, OP_NTYPES };
+
+struct bench_hist {
+	uint64_t	bh_count;
+	uint64_t	bh_bucket[HIST_NBUCKETS];
+};
+
+/* Single producer, single consumer queue of an xfree pair */
+struct bench_ring {
+	volatile unsigned long br_head __aligned(CACHE_LINE_SIZE);
+	volatile unsigned long br_tail __aligned(CACHE_LINE_SIZE);
+	volatile int	br_done;		/* Producer finished */
+	void		*br_obj[RING_SIZE];
+};
+
+struct bench_thread {
+	pthread_t	bt_tid;
+	unsigned int	bt_seed;		/* xorshift32 state */
+	unsigned int	bt_sample;		/* Ops until the next timed one */
+	uint64_t	bt_ops;			/* Allocs and frees done */
+	uint64_t	bt_start;		/* nsecs() when started */
+	uint64_t	bt_end;			/* nsecs() when done */
+	struct bench_ring *bt_ring;		/* xfree: ring of the pair */
+	int		bt_producer;		/* xfree: allocating side */
+	struct bench_hist bt_hist[OP_NTYPES];
+} __aligned(CACHE_LINE_SIZE);
+
+struct bench_pattern {
+	const char	*bp_name;
+	void		(*bp_run)(struct bench_thread *);
+};
+
+static void usage(void);
+static uint64_t ticks(void);
+static uint64_t nsecs(void);
+static unsigned int bench_random(struct bench_thread *);
+static size_t bench_size(struct bench_thread *);
+static unsigned int bench_interval(struct bench_thread *);
+static void *bench_alloc(struct bench_thread *);
+static void bench_free(struct bench_thread *, void *);
+static void hist_add(struct bench_hist *, uint64_t);
+static uint64_t hist_percentile(struct bench_hist *, unsigned int);
+static void run_local(struct bench_thread *);
+static void run_xfree(struct bench_thread *);
+static void run_burst(struct bench_thread *);
+static void run_mixed(struct bench_thread *);
+static void *bench_thread(void *);
+static void calibrate(void);
+static void run_bench(int, double *);
+
+static const struct bench_pattern patterns[] = {
+	{ "local",	run_local },
+	{ "xfree",	run_xfree },
+	{ "burst",	run_burst },
+	{ "mixed",	run_mixed },
+};
+#define	NPATTERNS	NELEM(patterns)
+
+static const struct bench_pattern *pattern;
+static size_t minsize, maxsize;
+static unsigned long nops;		/* Per thread */
+static unsigned int nlive;		/* Slots of local and mixed */
+static unsigned int batch;		/* Batch of burst */
+static unsigned int sampleint;		/* Time one in sampleint ops */
+static unsigned int seed;
+static double tickperns;		/* ticks() per nanosecond */
+static pthread_barrier_t startbar;
+static struct bench_thread threads[MAXTHREADS];
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: kmembench [-b batch] [-i interval] [-l live] "
+	    "[-n ops] [-p pattern]\n"
+	    "\t\t [-r seed] [-s size|min-max] [-t threads,...]\n");
+	exit(1);
+}
+
+/* Latency ticks: the TSC where there is one, else nanoseconds */
+static uint64_t
+ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return nsecs();
+#endif
+}
+
+static uint64_t
+nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int
+bench_random(struct bench_thread *bt)
+{
+	unsigned int x;
+
+	x = bt->bt_seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	bt->bt_seed = x;
+	return x;
+}
+
+static size_t
+bench_size(struct bench_thread *bt)
+{
+	if (minsize == maxsize)
+		return minsize;
+	return minsize + bench_random(bt) % (maxsize - minsize + 1);
+}
+
+/*
+ * Ops until the next timed one, sampleint on average.  A fixed
+ * interval would only ever time allocs of a pattern that alternates
+ * between allocs and frees.
+ */
+static unsigned int
+bench_interval(struct bench_thread *bt)
+{
+	return 1 + bench_random(bt) % (2 * sampleint - 1);
+}
+
+static void *
+bench_alloc(struct bench_thread *bt)
+{
+	uint64_t t0;
+	size_t size;
+	char *p;
+
+	size = bench_size(bt);
+	bt->bt_ops++;
+	if (--bt->bt_sample == 0) {
+		bt->bt_sample = bench_interval(bt);
+		t0 = ticks();
+		p = malloc(size);
+		hist_add(&bt->bt_hist[OP_ALLOC], ticks() - t0);
+	} else {
+		p = malloc(size);
+	}
+	if (p == NULL)
+		err(1, "malloc %zu", size);
+
+	/* Like a real user, touch the object */
+	p[0] = 1;
+	return p;
+}
+
+static void
+bench_free(struct bench_thread *bt, void *p)
+{
+	uint64_t t0;
+
+	bt->bt_ops++;
+	if (--bt->bt_sample == 0) {
+		bt->bt_sample = bench_interval(bt);
+		t0 = ticks();
+		free(p);
+		hist_add(&bt->bt_hist[OP_FREE], ticks() - t0);
+	} else {
+		free(p);
+	}
+}
+
+static void
+hist_add(struct bench_hist *bh, uint64_t v)
+{
+	int bits, idx;
+
+	if ((int64_t)v < 0)		/* TSCs of CPUs out of sync */
+		v = 0;
+	if (v < HIST_SUB) {
+		idx = v;
+	} else {
+		bits = 63 - __builtin_clzll(v);
+		idx = HIST_SUB + (bits - HIST_SUBBITS) * HIST_SUB +
+		    ((v >> (bits - HIST_SUBBITS)) & (HIST_SUB - 1));
+	}
+	bh->bh_bucket[idx]++;
+	bh->bh_count++;
+}
+
+/*
+ * Returns the upper bound of the bucket holding the permille-th
+ * permille of the samples.
+ */
+static uint64_t
+hist_percentile(struct bench_hist *bh, unsigned int permille)
+{
+	uint64_t seen, want;
+	int idx, bits;
+
+	if (bh->bh_count == 0)
+		return 0;
+	want = (bh->bh_count * permille + 999) / 1000;
+	seen = 0;
+	for (idx = 0; idx < HIST_NBUCKETS; idx++) {
+		seen += bh->bh_bucket[idx];
+		if (seen >= want)
+			break;
+	}
+	if (idx < HIST_SUB)
+		return idx;
+	bits = (idx - HIST_SUB) / HIST_SUB + HIST_SUBBITS;
+	return ((uint64_t)(HIST_SUB + (idx & (HIST_SUB - 1)) + 1)) <<
+	    (bits - HIST_SUBBITS);
+}
+
+static void
+run_local(struct bench_thread *bt)
+{
+	void **slot;
+	unsigned int i;
+
+	slot = calloc(nlive, sizeof(*slot));
+	if (slot == NULL)
+		err(1, "calloc");
+
+	while (bt->bt_ops < nops) {
+		i = bench_random(bt) % nlive;
+		if (slot[i] != NULL) {
+			bench_free(bt, slot[i]);
+			slot[i] = NULL;
+		} else {
+			slot[i] = bench_alloc(bt);
+		}
+	}
+
+	for (i = 0; i < nlive; i++)
+		if (slot[i] != NULL)
+			free(slot[i]);
+	free(slot);
+}
+
+/*
+ * The producer of a pair allocates nops / 2 objects and passes them
+ * to the consumer, which frees them, so every free is a remote one.
+ */
+static void
+run_xfree(struct bench_thread *bt)
+{
+	struct bench_ring *br;
+	unsigned long head, tail;
+
+	br = bt->bt_ring;
+	if (bt->bt_producer) {
+		while (bt->bt_ops < nops / 2) {
+			tail = br->br_tail;
+			while (tail - __atomic_load_n(&br->br_head,
+			    __ATOMIC_ACQUIRE) == RING_SIZE)
+				sched_yield();
+			br->br_obj[tail % RING_SIZE] = bench_alloc(bt);
+			__atomic_store_n(&br->br_tail, tail + 1, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&br->br_done, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	for (;;) {
+		head = br->br_head;
+		while (head == __atomic_load_n(&br->br_tail, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&br->br_done, __ATOMIC_ACQUIRE) &&
+			    head == __atomic_load_n(&br->br_tail,
+			    __ATOMIC_ACQUIRE))
+				return;
+			sched_yield();
+		}
+		bench_free(bt, br->br_obj[head % RING_SIZE]);
+		__atomic_store_n(&br->br_head, head + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void
+run_burst(struct bench_thread *bt)
+{
+	void **objs;
+	unsigned int i;
+
+	objs = malloc(batch * sizeof(*objs));
+	if (objs == NULL)
+		err(1, "malloc");
+
+	while (bt->bt_ops < nops) {
+		for (i = 0; i < batch; i++)
+			objs[i] = bench_alloc(bt);
+		for (i = 0; i < batch; i++)
+			bench_free(bt, objs[i]);
+	}
+	free(objs);
+}
+
+/*
+ * nlive long-lived objects, one in 64 ops replaces one of them.  The
+ * other ops go through a window of 16 short-lived objects.
+ */
+static void
+run_mixed(struct bench_thread *bt)
+{
+	void **live, *window[16];
+	unsigned int i, w;
+
+	live = malloc(nlive * sizeof(*live));
+	if (live == NULL)
+		err(1, "malloc");
+	for (i = 0; i < nlive; i++)
+		live[i] = malloc(bench_size(bt));
+	memset(window, 0, sizeof(window));
+
+	w = 0;
+	while (bt->bt_ops < nops) {
+		if (bench_random(bt) % 64 == 0) {
+			i = bench_random(bt) % nlive;
+			bench_free(bt, live[i]);
+			live[i] = bench_alloc(bt);
+		} else {
+			if (window[w] != NULL)
+				bench_free(bt, window[w]);
+			window[w] = bench_alloc(bt);
+			w = (w + 1) % NELEM(window);
+		}
+	}
+
+	for (i = 0; i < NELEM(window); i++)
+		free(window[i]);
+	for (i = 0; i < nlive; i++)
+		free(live[i]);
+	free(live);
+}
+
+static void *
+bench_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+
+	pthread_barrier_wait(&startbar);
+	bt->bt_start = nsecs();
+	pattern->bp_run(bt);
+	bt->bt_end = nsecs();
+
+	return NULL;
+}
+
+/*
+ * Measure how fast ticks() runs, to print latencies in nanoseconds.
+ */
+static void
+calibrate(void)
+{
+	uint64_t t0, t1, tick0, tick1;
+
+	t0 = nsecs();
+	tick0 = ticks();
+	usleep(50000);
+	t1 = nsecs();
+	tick1 = ticks();
+	tickperns = (double)(tick1 - tick0) / (t1 - t0);
+	if (tickperns <= 0)
+		tickperns = 1.0;
+}
+
+/*
+ * Run nthreads threads, print their results and return their
+ * throughput in ops per second.
+ */
+static void
+run_bench(int nthreads, double *opspersec)
+{
+	struct bench_ring *rings;
+	struct bench_hist hist[OP_NTYPES];
+	struct bench_thread *bt;
+	uint64_t t0, t1, ops;
+	int i, j, op, error;
+
+	rings = NULL;
+	if (pattern->bp_run == run_xfree) {
+		if (nthreads % 2 != 0)
+			errx(1, "xfree needs an even number of threads");
+		rings = calloc(nthreads / 2, sizeof(*rings));
+		if (rings == NULL)
+			err(1, "calloc");
+	}
+
+	memset(threads, 0, nthreads * sizeof(threads[0]));
+	if ((error = pthread_barrier_init(&startbar, NULL, nthreads + 1)) != 0)
+		errx(1, "pthread_barrier_init: %s", strerror(error));
+	for (i = 0; i < nthreads; i++) {
+		bt = &threads[i];
+		bt->bt_seed = seed * 2654435761U + i + 1;
+		bt->bt_sample = bench_interval(bt);
+		if (rings != NULL) {
+			bt->bt_ring = &rings[i / 2];
+			bt->bt_producer = i % 2 == 0;
+		}
+		if ((error = pthread_create(&bt->bt_tid, NULL, bench_thread,
+		    bt)) != 0)
+			errx(1, "pthread_create: %s", strerror(error));
+	}
+
+	pthread_barrier_wait(&startbar);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i].bt_tid, NULL);
+	pthread_barrier_destroy(&startbar);
+	free(rings);
+
+	/* From the first thread starting to the last one finishing */
+	memset(hist, 0, sizeof(hist));
+	ops = 0;
+	t0 = UINT64_MAX;
+	t1 = 0;
+	for (i = 0; i < nthreads; i++) {
+		bt = &threads[i];
+		ops += bt->bt_ops;
+		t0 = MIN(t0, bt->bt_start);
+		t1 = MAX(t1, bt->bt_end);
+		for (op = 0; op < OP_NTYPES; op++) {
+			hist[op].bh_count += bt->bt_hist[op].bh_count;
+			for (j = 0; j < HIST_NBUCKETS; j++)
+				hist[op].bh_bucket[j] += bt->bt_hist[op].bh_bucket[j];
+		}
+	}
+
+	*opspersec = ops * 1e9 / (t1 > t0 ? t1 - t0 : 1);
+	printf("%7d %9.2f", nthreads, *opspersec / 1e6);
+	for (op = 0; op < OP_NTYPES; op++)
+		printf("   %7.0f %7.0f %7.0f",
+		    hist_percentile(&hist[op], 500) / tickperns,
+		    hist_percentile(&hist[op], 990) / tickperns,
+		    hist_percentile(&hist[op], 999) / tickperns);
+}
+
+int
+main(int argc, char **argv)
+{
+	int nthreadlist[64], nthreadcnt;
+	const char *preload;
+	double opspersec, base;
+	char *p;
+	int ch, i, j;
+	long ncpu;
+
+	pattern = &patterns[0];
+	minsize = maxsize = 64;
+	nops = 1000000;
+	nlive = 1000;
+	batch = 1000;
+	sampleint = 16;
+	seed = 1;
+	nthreadcnt = 0;
+
+	while ((ch = getopt(argc, argv, "b:i:l:n:p:r:s:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batch = strtoul(optarg, &p, 10);
+			if (*p != '\0' || batch == 0)
+				errx(1, "invalid parameter to -b");
+			break;
+		case 'i':
+			sampleint = strtoul(optarg, &p, 10);
+			if (*p != '\0' || sampleint == 0)
+				errx(1, "invalid parameter to -i");
+			break;
+		case 'l':
+			nlive = strtoul(optarg, &p, 10);
+			if (*p != '\0' || nlive == 0)
+				errx(1, "invalid parameter to -l");
+			break;
+		case 'n':
+			nops = strtoul(optarg, &p, 10);
+			if (*p != '\0' || nops == 0)
+				errx(1, "invalid parameter to -n");
+			break;
+		case 'p':
+			for (i = 0; i < (int)NPATTERNS; i++)
+				if (strcmp(optarg, patterns[i].bp_name) == 0)
+					break;
+			if (i == (int)NPATTERNS)
+				errx(1, "unknown pattern `%s'", optarg);
+			pattern = &patterns[i];
+			break;
+		case 'r':
+			seed = strtoul(optarg, &p, 10);
+			if (*p != '\0')
+				errx(1, "invalid parameter to -r");
+			break;
+		case 's':
+			minsize = maxsize = strtoul(optarg, &p, 10);
+			if (*p == '-')
+				maxsize = strtoul(p + 1, &p, 10);
+			if (*p != '\0' || minsize == 0 || maxsize < minsize)
+				errx(1, "invalid parameter to -s");
+			break;
+		case 't':
+			nthreadcnt = 0;
+			p = optarg;
+			do {
+				if (nthreadcnt == NELEM(nthreadlist))
+					errx(1, "too many thread counts");
+				nthreadlist[nthreadcnt] = strtol(p, &p, 10);
+				if (nthreadlist[nthreadcnt] <= 0 ||
+				    nthreadlist[nthreadcnt] > MAXTHREADS ||
+				    (*p != ',' && *p != '\0'))
+					errx(1, "invalid parameter to -t");
+				nthreadcnt++;
+			} while (*p++ == ',');
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	/* Powers of two up to the number of CPUs */
+	if (nthreadcnt == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		for (i = 1; i <= MIN(ncpu, MAXTHREADS); i *= 2)
+			nthreadlist[nthreadcnt++] = i;
+		if (nthreadlist[nthreadcnt - 1] != MIN(ncpu, MAXTHREADS))
+			nthreadlist[nthreadcnt++] = MIN(ncpu, MAXTHREADS);
+	}
+	/* xfree runs pairs of threads */
+	if (pattern->bp_run == run_xfree) {
+		for (i = j = 0; i < nthreadcnt; i++) {
+			nthreadlist[j] = roundup(nthreadlist[i], 2);
+			if (j == 0 || nthreadlist[j] != nthreadlist[j - 1])
+				j++;
+		}
+		nthreadcnt = j;
+	}
+
+	calibrate();
+
+	preload = getenv("LD_PRELOAD");
+	if (preload != NULL && (p = strrchr(preload, '/')) != NULL)
+		preload = p + 1;
+	printf("# kmembench %s, sizes %zu-%zu, %lu ops per thread, "
+	    "malloc: %s\n", pattern->bp_name, minsize, maxsize, nops,
+	    preload != NULL && *preload != '\0' ? preload : "system");
+	printf("%7s %9s   %-23s   %-23s %8s\n", "", "", "alloc ns",
+	    "free ns", "");
+	printf("%7s %9s   %7s %7s %7s   %7s %7s %7s %8s\n", "threads",
+	    "Mops/s", "p50", "p99", "p99.9", "p50", "p99", "p99.9",
+	    "speedup");
+
+	base = 0;
+	for (i = 0; i < nthreadcnt; i++) {
+		run_bench(nthreadlist[i], &opspersec);
+		if (i == 0)
+			base = opspersec;
+		printf(" %8.2f\n", opspersec / base);
+		fflush(stdout);
+	}
+
+	return 0;
+}
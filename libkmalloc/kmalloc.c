@@ -0,0 +1,382 @@
+/*
+ * This code is derived from software contributed to The DragonFly Project
+ * by Simon Schubert <corecode@fs.ei.tum.de>.
+ *
+ * Copyright (c) 2004 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * malloc(3) on top of the kmem_alloc() size classes, for running
+ * unmodified programs with the slab allocator.  All classes from 16
+ * bytes up are multiples of 16 and aligned to it, which is what
+ * malloc() has to guarantee.  To compare against the system malloc,
+ *
+ *	LD_PRELOAD=libkmalloc.so.1 slaballoc -S -K
+ *
+ * runs the malloc test set of slabtest against it.  free() finds the
+ * cache of a buffer from the page it is in, or else frees the page
+ * span it heads.  Pointers the allocator doesn't know are ignored.
+ *
+ * kmem_init() runs on the first call.  If that ends up allocating
+ * itself, or anything else needs memory in the meantime on the same
+ * thread, it is served from a small static buffer that is never
+ * reused.  Other threads wait for the initialization to finish.
+ * Fork handlers take all allocator locks around fork(), so that a
+ * child of a threaded program can still allocate.
+ *
+ * If KMEM_DUMP names a file, a kmem_dump() of all caches is written
+ * to it every second, for slabtop to watch.  If the allocator was
+ * built with KMEM_RECORD and KMEM_RECORD names a file, an allocation
+ * trace is recorded to it until the program exits, which slabtest -R
+ * replays.  Allocations above KMEM_MAXBUF don't show up in it.
+ */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "vmem.h"
+
+#define	PAGESIZ			4096
+#define	KMALLOC_MINALIGN	16		/* What malloc() guarantees */
+#define	KMALLOC_BOOTSIZE	(64 * 1024)	/* Bootstrap buffer */
+#define	KMALLOC_DUMPINTERVAL	1000		/* msec between KMEM_DUMP dumps */
+
+#ifndef __aligned
+#define	__aligned(x)	__attribute__((__aligned__(x)))
+#endif
+
+/* Precedes every bootstrap allocation */
+struct kmalloc_boothdr {
+	size_t		kb_size;		/* Requested size */
+} __aligned(KMALLOC_MINALIGN);
+
+enum {
+	KMALLOC_UNINIT,
+	KMALLOC_INITIALIZING,
+	KMALLOC_READY
+};
+
+static int kmalloc_state;
+static pthread_t kmalloc_initthread;		/* Running kmem_init() */
+static pthread_mutex_t kmalloc_initlock = PTHREAD_MUTEX_INITIALIZER;
+
+static char kmalloc_bootbuf[KMALLOC_BOOTSIZE] __aligned(KMALLOC_MINALIGN);
+static size_t kmalloc_bootused;
+
+void *malloc(size_t);
+void free(void *);
+void *calloc(size_t, size_t);
+void *realloc(void *, size_t);
+int posix_memalign(void **, size_t, size_t);
+void *aligned_alloc(size_t, size_t);
+void *memalign(size_t, size_t);
+void *valloc(size_t);
+void *pvalloc(size_t);
+size_t malloc_usable_size(void *);
+
+static int kmalloc_init(void);
+static void *kmalloc_bootalloc(size_t, size_t);
+static void *kmalloc_memalign(size_t, size_t);
+
+/*
+ * Returns 0 if the allocator can't be used yet, because the calling
+ * thread is initializing it.
+ */
+static __inline int
+kmalloc_ready(void)
+{
+	if (__atomic_load_n(&kmalloc_state, __ATOMIC_ACQUIRE) == KMALLOC_READY)
+		return 1;
+
+	return kmalloc_init();
+}
+
+static int
+kmalloc_init(void)
+{
+	const char *dumppath, *recpath;
+	int started;
+
+	if (__atomic_load_n(&kmalloc_state, __ATOMIC_ACQUIRE) ==
+	    KMALLOC_INITIALIZING &&
+	    pthread_equal(kmalloc_initthread, pthread_self()))
+		return 0;
+
+	started = 0;
+	pthread_mutex_lock(&kmalloc_initlock);
+	if (kmalloc_state == KMALLOC_UNINIT) {
+		kmalloc_initthread = pthread_self();
+		__atomic_store_n(&kmalloc_state, KMALLOC_INITIALIZING,
+		    __ATOMIC_RELEASE);
+		kmem_init();
+		__atomic_store_n(&kmalloc_state, KMALLOC_READY, __ATOMIC_RELEASE);
+		started = 1;
+	}
+	pthread_mutex_unlock(&kmalloc_initlock);
+
+	/* These allocate, so only once malloc() works */
+	if (started)
+		pthread_atfork(kmem_fork_prepare, kmem_fork_parent,
+		    kmem_fork_child);
+	if (started && (dumppath = getenv("KMEM_DUMP")) != NULL &&
+	    *dumppath != '\0') {
+		kmem_maint_dump(dumppath, KMEM_DUMP_TEXT);
+		kmem_maint_start(KMALLOC_DUMPINTERVAL);
+	}
+	if (started && (recpath = getenv("KMEM_RECORD")) != NULL &&
+	    *recpath != '\0' && kmem_record_start(recpath) == 0)
+		atexit(kmem_record_stop);
+
+	return 1;
+}
+
+static __inline int
+kmalloc_isboot(void *ptr)
+{
+	return (char *)ptr >= kmalloc_bootbuf &&
+	    (char *)ptr < kmalloc_bootbuf + KMALLOC_BOOTSIZE;
+}
+
+/*
+ * Carve an allocation out of the bootstrap buffer.  Several threads
+ * can get here at once, if they all ran into a recursive allocation.
+ */
+static void *
+kmalloc_bootalloc(size_t size, size_t align)
+{
+	struct kmalloc_boothdr *kb;
+	size_t need, off;
+	uintptr_t p;
+
+	need = sizeof(*kb) + roundup(size, KMALLOC_MINALIGN) + align -
+	    KMALLOC_MINALIGN;
+	if (size > KMALLOC_BOOTSIZE ||
+	    (off = __atomic_fetch_add(&kmalloc_bootused, need,
+	    __ATOMIC_RELAXED)) + need > KMALLOC_BOOTSIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	p = roundup((uintptr_t)kmalloc_bootbuf + off + sizeof(*kb), align);
+	kb = (struct kmalloc_boothdr *)p - 1;
+	kb->kb_size = size;
+
+	return (void *)p;
+}
+
+void *
+malloc(size_t size)
+{
+	void *ptr;
+
+	if (!kmalloc_ready())
+		return kmalloc_bootalloc(size, KMALLOC_MINALIGN);
+
+	ptr = kmem_alloc(MAX(size, KMALLOC_MINALIGN), 0);
+	if (ptr == NULL)
+		errno = ENOMEM;
+
+	return ptr;
+}
+
+void
+free(void *ptr)
+{
+	struct kmem_cache *cp;
+	struct vmem *vm;
+
+	if (ptr == NULL || kmalloc_isboot(ptr))
+		return;
+
+	if ((cp = kmem_cache_lookup(ptr)) != NULL)
+		kmem_cache_free(cp, ptr);
+	else if ((vm = vmem_arena(ptr)) != NULL)
+		vmem_free(vm, ptr, vmem_size(ptr));
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	void *ptr;
+
+	if (size != 0 && n > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* The bootstrap buffer is never reused, so it is still zeroed */
+	if (!kmalloc_ready())
+		return kmalloc_bootalloc(n * size, KMALLOC_MINALIGN);
+
+	/*
+	 * Not through malloc(), which the compiler would turn into a
+	 * call to calloc() again.
+	 */
+	ptr = kmem_alloc(MAX(n * size, KMALLOC_MINALIGN), 0);
+	if (ptr == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(ptr, 0, n * size);
+
+	return ptr;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	size_t oldsize;
+	void *newptr;
+
+	if (ptr == NULL)
+		return malloc(size);
+	if (size == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	/* Stay in place unless that wastes more than half */
+	oldsize = malloc_usable_size(ptr);
+	if (size <= oldsize && size >= oldsize / 2)
+		return ptr;
+
+	newptr = malloc(size);
+	if (newptr == NULL)
+		return NULL;
+	memcpy(newptr, ptr, MIN(oldsize, size));
+	free(ptr);
+
+	return newptr;
+}
+
+/*
+ * Power of two size classes are naturally aligned up to a page, and
+ * everything larger is page aligned.  Larger alignments need a
+ * naturally aligned power of two page span.
+ */
+static void *
+kmalloc_memalign(size_t align, size_t size)
+{
+	size_t npages, s;
+	void *ptr;
+
+	if (align <= KMALLOC_MINALIGN)
+		return malloc(size);
+	if (!kmalloc_ready())
+		return kmalloc_bootalloc(size, align);
+	if (size > SIZE_MAX / 4 || align > SIZE_MAX / 4) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (align <= PAGESIZ) {
+		for (s = align; s < size; s *= 2)
+			;
+		ptr = kmem_alloc(s <= KMEM_MAXBUF ? s : size, 0);
+	} else {
+		for (npages = align / PAGESIZ; npages * PAGESIZ < size; npages *= 2)
+			;
+		ptr = vmem_alloc(kmem_arena, npages, VM_ALIGNED);
+	}
+	if (ptr == NULL)
+		errno = ENOMEM;
+
+	return ptr;
+}
+
+int
+posix_memalign(void **ptrp, size_t align, size_t size)
+{
+	void *ptr;
+
+	if (align < sizeof(void *) || (align & (align - 1)) != 0)
+		return EINVAL;
+
+	ptr = kmalloc_memalign(align, size);
+	if (ptr == NULL)
+		return ENOMEM;
+	*ptrp = ptr;
+
+	return 0;
+}
+
+void *
+aligned_alloc(size_t align, size_t size)
+{
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return kmalloc_memalign(align, size);
+}
+
+void *
+memalign(size_t align, size_t size)
+{
+	return aligned_alloc(align, size);
+}
+
+void *
+valloc(size_t size)
+{
+	return kmalloc_memalign(PAGESIZ, size);
+}
+
+void *
+pvalloc(size_t size)
+{
+	return kmalloc_memalign(PAGESIZ, roundup(size, PAGESIZ));
+}
+
+size_t
+malloc_usable_size(void *ptr)
+{
+	struct kmem_cache *cp;
+
+	if (ptr == NULL)
+		return 0;
+	if (kmalloc_isboot(ptr))
+		return ((struct kmalloc_boothdr *)ptr - 1)->kb_size;
+
+	if ((cp = kmem_cache_lookup(ptr)) != NULL)
+		return kmem_cache_bufsize(cp);
+	if (vmem_arena(ptr) != NULL)
+		return vmem_size(ptr) * PAGESIZ;
+
+	return 0;
+}
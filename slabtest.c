@@ -36,15 +36,39 @@
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#endif
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "alloc.h"
+#include "vmem.h"
+
+/*
+ * AddressSanitizer aborts on invalid allocation requests instead of
+ * failing them, so the checks that make them are left out.
+ */
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) && !defined(__SANITIZE_ADDRESS__)
+#define	__SANITIZE_ADDRESS__	1
+#endif
+#endif
 
 
 struct cache_info {
@@ -123,8 +147,11 @@ test_kmem_stats(struct cache_info *chs)
 		complete.kcs_allocs += s.kcs_allocs;
 		complete.kcs_misses += s.kcs_misses;
 	}
-	printf("\ntotal %i/%i=%i%%\n", complete.kcs_misses, complete.kcs_allocs,
-		complete.kcs_misses * 100 / complete.kcs_allocs);
+	printf("\ntotal %ju/%ju=%ju%%\n", (uintmax_t)complete.kcs_misses,
+		(uintmax_t)complete.kcs_allocs,
+		(uintmax_t)(complete.kcs_misses * 100 / complete.kcs_allocs));
+
+	vmem_debug(kmem_arena);
 }
 
 void
@@ -143,6 +170,111 @@ struct test_set kmem_set = {
 	test_kmem_cleanup
 };
 
+#define	CDTOR_MAGIC	0x6b6d656dUL
+#define	CDTOR_OBJS	1000
+
+unsigned long cdtor_ctors, cdtor_dtors;
+
+void
+test_cdtor_ctor(void *obj, size_t size)
+{
+	*(unsigned long *)obj = CDTOR_MAGIC;
+	cdtor_ctors++;
+}
+
+void
+test_cdtor_dtor(void *obj, size_t size)
+{
+	if (*(unsigned long *)obj != CDTOR_MAGIC)
+		errx(1, "destructor called on an unconstructed buf");
+	cdtor_dtors++;
+}
+
+/*
+ * A destructor has to run exactly on the constructed bufs.  A cache
+ * with a destructor but no constructor has none, and is refused.
+ */
+void
+do_cdtor_test(void)
+{
+	struct kmem_cache *cache;
+	void *objs[CDTOR_OBJS];
+	int i;
+
+	printf("testing constructors\n");
+	kmem_init();
+
+	if (kmem_cache_create("dtoronly", 100, 0, NULL,
+	    test_cdtor_dtor) != NULL)
+		errx(1, "cache with only a destructor created");
+
+	cache = kmem_cache_create("cdtor", 100, 0, test_cdtor_ctor,
+	    test_cdtor_dtor);
+	if (cache == NULL)
+		errx(1, "kmem_cache_create");
+	for (i = 0; i < CDTOR_OBJS; i++) {
+		objs[i] = kmem_cache_alloc(cache, 0);
+		if (objs[i] == NULL)
+			errx(1, "kmem_cache_alloc");
+		if (*(unsigned long *)objs[i] != CDTOR_MAGIC)
+			errx(1, "unconstructed buf allocated");
+	}
+	for (i = 0; i < CDTOR_OBJS; i++)
+		kmem_cache_free(cache, objs[i]);
+	kmem_cache_destroy(cache);
+
+	if (cdtor_dtors != cdtor_ctors)
+		errx(1, "%lu bufs constructed, %lu destructed", cdtor_ctors,
+		    cdtor_dtors);
+	printf("constructors passed, %lu bufs\n", cdtor_ctors);
+}
+
+void
+test_kmem_alloc_free(void *obj)
+{
+	struct testitem *itm = obj;
+
+	kmem_free(itm, itm->cache->size);
+}
+
+void *
+test_kmem_alloc_alloc(struct cache_info *cache)
+{
+	return kmem_alloc(cache->size, 0);
+}
+
+struct test_set kmem_alloc_set = {
+	"kmem_alloc",
+	test_kmem_init,
+	NULL,
+	test_kmem_alloc_free,
+	test_kmem_alloc_alloc,
+	NULL,
+	NULL
+};
+
+/*
+ * Sizes beyond what the page layer can hold have to fail, not wrap.
+ */
+void
+do_kmem_alloc_limit_test(void)
+{
+	static const size_t sizes[] = {
+		SIZE_MAX, SIZE_MAX - 4095, SIZE_MAX / 2 + 1, SIZE_MAX / 4096
+	};
+	unsigned int i;
+
+	printf("testing kmem_alloc limits\n");
+	kmem_init();
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (kmem_alloc(sizes[i], 0) != NULL)
+			errx(1, "kmem_alloc(%#zx) succeeded", sizes[i]);
+	}
+
+	printf("kmem_alloc limits passed\n");
+}
+
 void
 test_null(void)
 {
@@ -170,6 +302,1028 @@ struct test_set malloc_set = {
 	NULL
 };
 
+#define	MEMALIGN_MAX	(1UL << 30)	/* Beyond the 64MB vmem regions */
+#define	MEMALIGN_SIZE	(64 * 1024)	/* Largest size tried */
+
+/*
+ * Check that posix_memalign() and aligned_alloc() hand out aligned,
+ * usable memory for every power of two alignment up to MEMALIGN_MAX,
+ * and reject alignments that aren't a power of two.  aligned_alloc()
+ * only takes multiples of the alignment.
+ */
+void
+do_memalign_test(void)
+{
+	size_t align, size, asize;
+	char *p;
+	int error;
+
+	printf("testing memalign\n");
+
+	for (align = sizeof(void *); align <= MEMALIGN_MAX; align *= 2) {
+		for (size = 1; size <= MEMALIGN_SIZE; size = size * 4 + 1) {
+			error = posix_memalign((void **)&p, align, size);
+			if (error != 0)
+				errx(1, "posix_memalign(%zu, %zu): %s", align,
+				    size, strerror(error));
+			if ((uintptr_t)p & (align - 1))
+				errx(1, "posix_memalign(%zu, %zu) = %p: "
+				    "misaligned", align, size, p);
+			p[0] = p[size - 1] = 1;
+			free(p);
+
+			asize = (size + align - 1) & ~(align - 1);
+			p = aligned_alloc(align, asize);
+			if (p == NULL)
+				err(1, "aligned_alloc(%zu, %zu)", align, asize);
+			if ((uintptr_t)p & (align - 1))
+				errx(1, "aligned_alloc(%zu, %zu) = %p: "
+				    "misaligned", align, asize, p);
+			p[0] = p[asize - 1] = 1;
+			free(p);
+		}
+	}
+
+#ifndef __SANITIZE_ADDRESS__
+	if (posix_memalign((void **)&p, 3 * sizeof(void *), 1) != EINVAL)
+		errx(1, "posix_memalign accepts a bad alignment");
+#endif
+
+	printf("memalign passed, alignments up to %lu\n", MEMALIGN_MAX);
+}
+
+/*
+ * Sizes no allocator can satisfy have to fail with ENOMEM.  The size
+ * is volatile, so the compiler can't reason about the calls.
+ */
+void
+do_malloc_limit_test(void)
+{
+	static const size_t sizes[] = {
+		SIZE_MAX, SIZE_MAX - 4095, SIZE_MAX / 2 + 1
+	};
+	volatile size_t size;
+	unsigned int i;
+	char *p, *q;
+
+	printf("testing malloc limits\n");
+
+	p = malloc(16);
+	if (p == NULL)
+		err(1, "malloc");
+	memset(p, 'x', 16);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size = sizes[i];
+
+		errno = 0;
+		if ((q = malloc(size)) != NULL || errno != ENOMEM)
+			errx(1, "malloc(%#zx) = %p, errno %d", size, q, errno);
+		errno = 0;
+		if ((q = calloc(1, size)) != NULL || errno != ENOMEM)
+			errx(1, "calloc(1, %#zx) = %p, errno %d", size, q, errno);
+		errno = 0;
+		if ((q = calloc(size, 2)) != NULL || errno != ENOMEM)
+			errx(1, "calloc(%#zx, 2) = %p, errno %d", size, q, errno);
+		errno = 0;
+		if ((q = realloc(p, size)) != NULL || errno != ENOMEM)
+			errx(1, "realloc(p, %#zx) = %p, errno %d", size, q,
+			    errno);
+		if (p[0] != 'x' || p[15] != 'x')
+			errx(1, "failed realloc() changed the old buffer");
+	}
+	free(p);
+
+	printf("malloc limits passed\n");
+}
+
+
+double
+elapsed(struct timeval *t_start)
+{
+	struct timeval t_end;
+
+	gettimeofday(&t_end, NULL);
+	timersub(&t_end, t_start, &t_end);
+	return (double)t_end.tv_sec + (double)t_end.tv_usec / 1000000;
+}
+
+/*
+ * Measure the cost of returning bufs to the slab layer of a multi-page
+ * cache, depending on the number of outstanding objects.  Three out of
+ * four objects are freed into the magazines, which keeps all slabs
+ * around, and kmem_reclaim() then pushes them through the slab layer.
+ */
+void
+do_free_bench(void)
+{
+	struct kmem_cache *cache;
+	struct timeval t_start;
+	unsigned long live, i;
+	double t_alloc, t_free;
+	void **objs;
+
+	printf("testing slab layer free latency\n");
+
+	kmem_init();
+
+	for (live = 1024; live <= 65536; live *= 2) {
+		objs = malloc(live * sizeof(*objs));
+		if (objs == NULL)
+			err(1, "malloc");
+
+		cache = kmem_cache_create("freebench", 3000, 0, NULL, NULL);
+
+		gettimeofday(&t_start, NULL);
+		for (i = 0; i < live; ++i) {
+			objs[i] = kmem_cache_alloc(cache, 0);
+			memset(objs[i], 0, 3000);
+		}
+		t_alloc = elapsed(&t_start);
+
+		for (i = 0; i < live; ++i)
+			if (i % 4 != 0)
+				kmem_cache_free(cache, objs[i]);
+
+		gettimeofday(&t_start, NULL);
+		kmem_reclaim((size_t)-1);
+		t_free = elapsed(&t_start);
+
+		printf("%6lu live: alloc %6.1f ns\tslab free %6.1f ns per object\n",
+		    live, t_alloc / live * 1e9, t_free / (live - live / 4) * 1e9);
+
+		for (i = 0; i < live; i += 4)
+			kmem_cache_free(cache, objs[i]);
+		kmem_cache_destroy(cache);
+		free(objs);
+	}
+}
+
+/*
+ * Compare allocating and freeing batches of objects one at a time
+ * with the bulk interface.
+ */
+void
+do_bulk_bench(void)
+{
+	struct kmem_cache *cache;
+	struct timeval t_start;
+	void *objs[256];
+	size_t batch, i, got;
+	long n, rounds;
+	double t_single, t_bulk;
+
+	printf("testing bulk alloc/free\n");
+
+	kmem_init();
+	cache = kmem_cache_create("bulkbench", 256, 0, NULL, NULL);
+
+	for (batch = 16; batch <= 256; batch *= 2) {
+		rounds = iterations * 100 / batch;
+
+		/* Warm up the magazines and slabs */
+		got = kmem_cache_alloc_bulk(cache, 0, batch, objs);
+		if (got != batch)
+			errx(1, "kmem_cache_alloc_bulk");
+		kmem_cache_free_bulk(cache, batch, objs);
+
+		gettimeofday(&t_start, NULL);
+		for (n = 0; n < rounds; n++) {
+			for (i = 0; i < batch; i++)
+				objs[i] = kmem_cache_alloc(cache, 0);
+			for (i = 0; i < batch; i++)
+				kmem_cache_free(cache, objs[i]);
+		}
+		t_single = elapsed(&t_start);
+
+		gettimeofday(&t_start, NULL);
+		for (n = 0; n < rounds; n++) {
+			kmem_cache_alloc_bulk(cache, 0, batch, objs);
+			kmem_cache_free_bulk(cache, batch, objs);
+		}
+		t_bulk = elapsed(&t_start);
+
+		printf("batch %3zu: single %5.1f ns\tbulk %5.1f ns per alloc/free\n",
+		    batch, t_single / (rounds * batch) * 1e9,
+		    t_bulk / (rounds * batch) * 1e9);
+	}
+
+	kmem_cache_destroy(cache);
+}
+
+/*
+ * Chase pointers through a random cycle of objects spread over far
+ * more pages than the TLB covers, once with slabs carved from small
+ * pages and once from huge pages.
+ */
+void
+do_tlb_bench(void)
+{
+	struct kmem_cache_attr attr;
+	struct kmem_cache *cache;
+	struct timeval t_start;
+	void **objs, **p, *tmp;
+	unsigned long nobjs, i, j;
+	double t_chase;
+	int huge;
+
+	printf("testing TLB reach\n");
+
+	kmem_init();
+	srandom(randseed);
+
+	nobjs = 1UL << 21;		/* 256MB of 128 byte objects */
+	objs = malloc(nobjs * sizeof(*objs));
+	if (objs == NULL)
+		err(1, "malloc");
+
+	for (huge = 0; huge <= 1; huge++) {
+		kmem_cache_attr_init(&attr);
+		if (huge)
+			attr.kca_flags |= KMCA_HUGEPAGE;
+		cache = kmem_cache_create_attr("tlbbench", 128, 0, NULL, NULL,
+		    &attr);
+		if (cache == NULL)
+			errx(1, "kmem_cache_create_attr");
+
+		for (i = 0; i < nobjs; i++) {
+			objs[i] = kmem_cache_alloc(cache, 0);
+			if (objs[i] == NULL)
+				errx(1, "kmem_cache_alloc");
+		}
+
+		/* Link the objects into one random cycle */
+		for (i = nobjs - 1; i > 0; i--) {
+			j = random() % (i + 1);
+			tmp = objs[i];
+			objs[i] = objs[j];
+			objs[j] = tmp;
+		}
+		for (i = 0; i < nobjs; i++)
+			*(void **)objs[i] = objs[(i + 1) % nobjs];
+
+		p = objs[0];
+		gettimeofday(&t_start, NULL);
+		for (i = 0; i < 4 * nobjs; i++)
+			p = *p;
+		t_chase = elapsed(&t_start);
+		if (p != objs[0])
+			errx(1, "broken object cycle");
+
+		printf("%s pages: %5.1f ns per access\n",
+		    huge ? "huge " : "small", t_chase / (4 * nobjs) * 1e9);
+
+		for (i = 0; i < nobjs; i++)
+			kmem_cache_free(cache, objs[i]);
+		kmem_cache_destroy(cache);
+	}
+
+	if (verbose)
+		vmem_debug(kmem_hugearena);
+
+	free(objs);
+}
+
+/*
+ * Cost of growing a cache: allocate objects into a fresh cache
+ * without touching them, and report time and minor page faults per
+ * new slab.  As bufs are carved off a slab on demand, a new slab
+ * should cost about the same no matter how many bufs it holds.
+ */
+void
+do_slab_bench(void)
+{
+	static const size_t sizes[] = { 64, 1024, 9000 };
+	struct kmem_cache_stats stats;
+	struct kmem_cache *cache;
+	struct rusage ru_start, ru_end;
+	struct timeval t_start;
+	unsigned long nobjs, i;
+	long minflt;
+	double t_alloc;
+	size_t s;
+	void **objs;
+
+	printf("testing slab creation\n");
+
+	kmem_init();
+
+	nobjs = iterations * 10;
+	objs = malloc(nobjs * sizeof(*objs));
+	if (objs == NULL)
+		err(1, "malloc");
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		cache = kmem_cache_create("slabbench", sizes[s], 0, NULL, NULL);
+
+		getrusage(RUSAGE_SELF, &ru_start);
+		gettimeofday(&t_start, NULL);
+		for (i = 0; i < nobjs; i++) {
+			objs[i] = kmem_cache_alloc(cache, 0);
+			if (objs[i] == NULL)
+				errx(1, "kmem_cache_alloc");
+		}
+		t_alloc = elapsed(&t_start);
+		getrusage(RUSAGE_SELF, &ru_end);
+		minflt = ru_end.ru_minflt - ru_start.ru_minflt;
+
+		kmem_cache_getstats(cache, &stats);
+		if (stats.kcs_slabcreates == 0)
+			stats.kcs_slabcreates = 1;
+		printf("%5zu bytes: %6ju slabs\t%8.1f ns\t%6.2f minflt per slab"
+		    "\t%6.1f ns per alloc\n",
+		    sizes[s], (uintmax_t)stats.kcs_slabcreates,
+		    t_alloc / stats.kcs_slabcreates * 1e9,
+		    (double)minflt / stats.kcs_slabcreates, t_alloc / nobjs * 1e9);
+
+		for (i = 0; i < nobjs; i++)
+			kmem_cache_free(cache, objs[i]);
+		kmem_cache_destroy(cache);
+	}
+
+	free(objs);
+}
+
+/*
+ * Free tracking with the freelist against the free map.  Fill a
+ * cache, free three out of four objects in random order and push them
+ * back to the slabs, then allocate them again out of the partially
+ * used slabs.
+ */
+void
+do_bitmap_bench(void)
+{
+	static const size_t sizes[] = { 32, 256, 4000 };
+	struct kmem_cache_attr attr;
+	struct kmem_cache *cache;
+	struct timeval t_start;
+	unsigned long nobjs, nfree, i, j, tmp;
+	unsigned long *order;
+	double t_fill, t_drain, t_refill;
+	size_t s;
+	int bitmap;
+	void **objs;
+
+	printf("testing freelist vs. free map\n");
+
+	kmem_init();
+	srandom(randseed);
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		nobjs = (64UL << 20) / sizes[s];
+		nfree = nobjs - nobjs / 4;
+		objs = malloc(nobjs * sizeof(*objs));
+		order = malloc(nobjs * sizeof(*order));
+		if (objs == NULL || order == NULL)
+			err(1, "malloc");
+
+		for (bitmap = 0; bitmap <= 1; bitmap++) {
+			kmem_cache_attr_init(&attr);
+			if (bitmap)
+				attr.kca_flags |= KMCA_BITMAP;
+			cache = kmem_cache_create_attr("bitmapbench", sizes[s], 0,
+			    NULL, NULL, &attr);
+			if (cache == NULL)
+				errx(1, "kmem_cache_create_attr");
+
+			gettimeofday(&t_start, NULL);
+			for (i = 0; i < nobjs; i++) {
+				objs[i] = kmem_cache_alloc(cache, 0);
+				if (objs[i] == NULL)
+					errx(1, "kmem_cache_alloc");
+			}
+			t_fill = elapsed(&t_start);
+
+			for (i = 0; i < nobjs; i++)
+				order[i] = i;
+			for (i = nobjs - 1; i > 0; i--) {
+				j = random() % (i + 1);
+				tmp = order[i];
+				order[i] = order[j];
+				order[j] = tmp;
+			}
+			for (i = 0; i < nfree; i++)
+				kmem_cache_free(cache, objs[order[i]]);
+
+			gettimeofday(&t_start, NULL);
+			kmem_reclaim((size_t)-1);
+			t_drain = elapsed(&t_start);
+
+			gettimeofday(&t_start, NULL);
+			for (i = 0; i < nfree; i++) {
+				objs[order[i]] = kmem_cache_alloc(cache, 0);
+				if (objs[order[i]] == NULL)
+					errx(1, "kmem_cache_alloc");
+			}
+			t_refill = elapsed(&t_start);
+
+			printf("%4zu bytes %-8s: fill %5.1f ns\tdrain %5.1f ns"
+			    "\trefill %5.1f ns per object\n",
+			    sizes[s], bitmap ? "free map" : "freelist",
+			    t_fill / nobjs * 1e9, t_drain / nfree * 1e9,
+			    t_refill / nfree * 1e9);
+			if (verbose)
+				kmem_cache_debug(cache);
+
+			for (i = 0; i < nobjs; i++)
+				kmem_cache_free(cache, objs[i]);
+			kmem_cache_destroy(cache);
+		}
+
+		free(order);
+		free(objs);
+	}
+}
+
+/*
+ * L1D and last level cache read miss counters, where the system
+ * provides them.
+ */
+#define	COLOR_NCOUNTERS	2
+#define	NELEM(a)	(sizeof(a) / sizeof((a)[0]))
+
+static int
+color_counters_open(int *fds)
+{
+#ifdef __linux__
+	static const unsigned long long configs[COLOR_NCOUNTERS] = {
+		PERF_COUNT_HW_CACHE_L1D |
+		    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_LL |
+		    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	};
+	struct perf_event_attr pe;
+	int i;
+
+	for (i = 0; i < COLOR_NCOUNTERS; i++) {
+		memset(&pe, 0, sizeof(pe));
+		pe.type = PERF_TYPE_HW_CACHE;
+		pe.size = sizeof(pe);
+		pe.config = configs[i];
+		pe.disabled = 1;
+		pe.exclude_kernel = 1;
+		pe.exclude_hv = 1;
+		fds[i] = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+		if (fds[i] < 0) {
+			warn("perf_event_open");
+			while (--i >= 0)
+				close(fds[i]);
+			return -1;
+		}
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void
+color_counters_start(int *fds)
+{
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < COLOR_NCOUNTERS; i++) {
+		ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static void
+color_counters_stop(int *fds, unsigned long long *counts)
+{
+	int i;
+
+	for (i = 0; i < COLOR_NCOUNTERS; i++) {
+		counts[i] = 0;
+#ifdef __linux__
+		ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i]))
+			counts[i] = 0;
+#endif
+	}
+}
+
+/*
+ * Walk the first cache line of objects spread over many slabs, with
+ * slab coloring off, sequential and random.  Without coloring, bufs
+ * at the same index of all slabs map to the same cache sets, and a
+ * working set that would fit into the L1 keeps missing.
+ */
+void
+do_color_bench(void)
+{
+	static const size_t sizes[] = { 512, 1024, 2048 };
+	static const unsigned long working[] = { 512, 4096 };
+	static const struct {
+		const char	*name;
+		int		flags;
+	} modes[] = {
+		{ "none", KMCA_NOCOLOR },
+		{ "seq", 0 },
+		{ "random", KMCA_COLORRANDOM },
+	};
+	struct kmem_cache_attr attr;
+	struct kmem_cache *cache;
+	struct timeval t_start;
+	unsigned long long counts[COLOR_NCOUNTERS];
+	unsigned long nobjs, rounds, sum, r, i;
+	int fds[COLOR_NCOUNTERS];
+	int havecounters;
+	size_t s, w, m;
+	double t_walk;
+	void **objs;
+
+	printf("testing slab coloring\n");
+
+	kmem_init();
+
+	havecounters = color_counters_open(fds) == 0;
+	if (!havecounters)
+		printf("cache miss counters unavailable, timing only\n");
+
+	objs = malloc(working[NELEM(working) - 1] * sizeof(*objs));
+	if (objs == NULL)
+		err(1, "malloc");
+
+	for (s = 0; s < NELEM(sizes); s++) {
+		for (w = 0; w < NELEM(working); w++) {
+			nobjs = working[w];
+			rounds = iterations * 1000 / nobjs;
+			if (rounds == 0)
+				rounds = 1;
+
+			for (m = 0; m < NELEM(modes); m++) {
+				kmem_cache_attr_init(&attr);
+				attr.kca_flags |= modes[m].flags;
+				cache = kmem_cache_create_attr("colorbench",
+				    sizes[s], 0, NULL, NULL, &attr);
+				if (cache == NULL)
+					errx(1, "kmem_cache_create_attr");
+				if (verbose)
+					kmem_cache_debug(cache);
+
+				for (i = 0; i < nobjs; i++) {
+					objs[i] = kmem_cache_alloc(cache, 0);
+					if (objs[i] == NULL)
+						errx(1, "kmem_cache_alloc");
+					*(unsigned long *)objs[i] = i;
+				}
+
+				if (havecounters)
+					color_counters_start(fds);
+				gettimeofday(&t_start, NULL);
+				sum = 0;
+				for (r = 0; r < rounds; r++)
+					for (i = 0; i < nobjs; i++)
+						sum += *(volatile unsigned long *)objs[i];
+				t_walk = elapsed(&t_start);
+				if (havecounters)
+					color_counters_stop(fds, counts);
+				if (sum != rounds * (nobjs * (nobjs - 1) / 2))
+					errx(1, "objects changed under us");
+
+				printf("%4zu bytes %4lu objs %-6s: %5.2f ns",
+				    sizes[s], nobjs, modes[m].name,
+				    t_walk / (rounds * nobjs) * 1e9);
+				if (havecounters)
+					printf("\tL1D miss %5.3f\tLL miss %5.3f per access",
+					    (double)counts[0] / (rounds * nobjs),
+					    (double)counts[1] / (rounds * nobjs));
+				printf("\n");
+
+				for (i = 0; i < nobjs; i++)
+					kmem_cache_free(cache, objs[i]);
+				kmem_cache_destroy(cache);
+			}
+		}
+	}
+
+	if (havecounters)
+		for (i = 0; i < COLOR_NCOUNTERS; i++)
+			close(fds[i]);
+	free(objs);
+}
+
+/*
+ * Simulated two node topology: CPUs 0 and 1 on node 0, 2 and 3 on
+ * node 1, one thread each.  Every thread allocates its share, and
+ * the thread on the other node frees it.
+ */
+#define	NUMA_THREADS	4
+#define	NUMA_NODEMAP	"0,0,1,1"
+
+struct numa_thread {
+	pthread_t	tid;
+	int		cpu;
+	unsigned long	foreign;	/* Allocated objects of other nodes */
+	double		t_alloc, t_free;
+	void		**objs;
+};
+
+static struct kmem_cache *numa_cache;
+static pthread_barrier_t numa_barrier;
+static struct numa_thread numa_threads[NUMA_THREADS];
+
+static void *
+numa_thread_run(void *arg)
+{
+	struct numa_thread *nt = arg, *other;
+	struct timeval t_start;
+	unsigned long i;
+
+	kmem_thread_setcpu(nt->cpu);
+
+	gettimeofday(&t_start, NULL);
+	for (i = 0; i < iterations; i++) {
+		nt->objs[i] = kmem_cache_alloc(numa_cache, 0);
+		if (nt->objs[i] == NULL)
+			errx(1, "kmem_cache_alloc");
+	}
+	nt->t_alloc = elapsed(&t_start);
+
+	for (i = 0; i < iterations; i++) {
+		if (vmem_node(nt->objs[i]) != nt->cpu * 2 / NUMA_THREADS)
+			nt->foreign++;
+	}
+
+	pthread_barrier_wait(&numa_barrier);
+
+	other = &numa_threads[(nt->cpu + NUMA_THREADS / 2) % NUMA_THREADS];
+	gettimeofday(&t_start, NULL);
+	for (i = 0; i < iterations; i++)
+		kmem_cache_free(numa_cache, other->objs[i]);
+	nt->t_free = elapsed(&t_start);
+
+	return NULL;
+}
+
+void
+do_numa_test(void)
+{
+	struct kmem_cache_stats stats;
+	struct numa_thread *nt;
+	int i;
+
+	printf("testing NUMA placement, node map %s\n", getenv("KMEM_NODEMAP"));
+
+	kmem_init();
+	numa_cache = kmem_cache_create("numatest", 256, 0, NULL, NULL);
+	pthread_barrier_init(&numa_barrier, NULL, NUMA_THREADS);
+
+	for (i = 0; i < NUMA_THREADS; i++) {
+		nt = &numa_threads[i];
+		nt->cpu = i;
+		nt->foreign = 0;
+		nt->objs = malloc(iterations * sizeof(*nt->objs));
+		if (nt->objs == NULL)
+			err(1, "malloc");
+		if (pthread_create(&nt->tid, NULL, numa_thread_run, nt) != 0)
+			errx(1, "pthread_create");
+	}
+
+	for (i = 0; i < NUMA_THREADS; i++)
+		pthread_join(numa_threads[i].tid, NULL);
+
+	for (i = 0; i < NUMA_THREADS; i++) {
+		nt = &numa_threads[i];
+		printf("cpu%d: alloc %5.1f ns\tremote free %5.1f ns\tforeign objects: %lu\n",
+		    i, nt->t_alloc / iterations * 1e9, nt->t_free / iterations * 1e9,
+		    nt->foreign);
+		free(nt->objs);
+	}
+
+	kmem_cache_getstats(numa_cache, &stats);
+	printf("remote frees: %ju\n", (uintmax_t)stats.kcs_remotefree);
+	if (verbose)
+		kmem_cache_debug(numa_cache);
+
+	/* Asserts that every buf made it back to its own node's slabs */
+	kmem_cache_destroy(numa_cache);
+	pthread_barrier_destroy(&numa_barrier);
+}
+
+/*
+ * Replay of an allocation trace, recorded by an allocator built with
+ * KMEM_RECORD.  The trace is mapped and streamed through in order,
+ * once through caches of the slab allocator and once through malloc(),
+ * each in a child process so they don't share a peak RSS.  Replay runs
+ * in one thread; for the slab allocator each recorded thread gets a
+ * simulated CPU of its own, so the magazines see the recorded mix.
+ * Fragmentation is the part of the memory held at the peak of live
+ * bytes that no live object used.
+ */
+#define	REPLAY_SAMPLE	1024		/* Records between footprint checks */
+#define	REPLAY_DROP	65536		/* Records between dropping the trace */
+
+enum { REPLAY_KMEM, REPLAY_MALLOC };
+
+struct replay_cache {
+	struct kmem_cache *cache;	/* REPLAY_KMEM only */
+	size_t		size;
+	unsigned long	live;		/* Objects allocated */
+	int		created;
+};
+
+/* Open addressing hash from recorded to replayed objects */
+struct replay_obj {
+	uint64_t	key;		/* Recorded address, 0 if free */
+	void		*obj;
+};
+
+struct replay_map {
+	struct replay_obj *objs;
+	size_t		mask;
+	size_t		count;
+};
+
+static struct replay_obj *
+replay_lookup(struct replay_map *map, uint64_t key)
+{
+	size_t i;
+
+	/* The low bits of addresses are mostly zero */
+	i = (key >> 4) * 0x9e3779b97f4a7c15ULL >> 20;
+	for (;; i++) {
+		i &= map->mask;
+		if (map->objs[i].key == key || map->objs[i].key == 0)
+			return &map->objs[i];
+	}
+}
+
+static void
+replay_insert(struct replay_map *map, uint64_t key, void *obj)
+{
+	struct replay_obj *old, *ro;
+	size_t i;
+
+	if ((map->count + 1) * 2 > map->mask + 1) {
+		old = map->objs;
+		map->mask = map->mask * 2 + 1;
+		map->objs = calloc(map->mask + 1, sizeof(*map->objs));
+		if (map->objs == NULL)
+			err(1, "calloc");
+		for (i = 0; i <= map->mask / 2; i++)
+			if (old[i].key != 0)
+				*replay_lookup(map, old[i].key) = old[i];
+		free(old);
+	}
+
+	ro = replay_lookup(map, key);
+	if (ro->key == 0)
+		map->count++;
+	ro->key = key;
+	ro->obj = obj;
+}
+
+/*
+ * Remove ro, moving later entries of its probe sequence up so lookups
+ * don't stop early.
+ */
+static void
+replay_remove(struct replay_map *map, struct replay_obj *ro)
+{
+	size_t i, j, home;
+
+	i = ro - map->objs;
+	for (j = (i + 1) & map->mask; map->objs[j].key != 0;
+	    j = (j + 1) & map->mask) {
+		home = (map->objs[j].key >> 4) * 0x9e3779b97f4a7c15ULL >> 20;
+		home &= map->mask;
+		/* Can the entry at j move to i? */
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && (home <= i && home > j))) {
+			map->objs[i] = map->objs[j];
+			i = j;
+		}
+	}
+	map->objs[i].key = 0;
+	map->count--;
+}
+
+/* Bytes the allocator holds for the objects */
+static uint64_t
+replay_footprint(int mode, struct replay_cache *caches, uint32_t ncaches)
+{
+	struct kmem_cache_stats stats;
+	uint64_t bytes;
+	uint32_t i;
+
+	bytes = 0;
+	if (mode == REPLAY_KMEM) {
+		for (i = 0; i < ncaches; i++) {
+			if (caches[i].cache == NULL)
+				continue;
+			kmem_cache_getstats(caches[i].cache, &stats);
+			bytes += stats.kcs_pages * 4096;
+		}
+	} else {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+		struct mallinfo2 mi;
+
+		mi = mallinfo2();
+		bytes = mi.arena + mi.hblkhd;
+#endif
+	}
+	return bytes;
+}
+
+static void
+replay_run(int mode, const struct kmem_record *recs, size_t nrecs)
+{
+	const struct kmem_record *kr;
+	struct replay_cache *caches, *rc;
+	struct replay_map map;
+	struct replay_obj *ro;
+	struct rusage ru;
+	struct timeval t_start;
+	uint64_t live, peak, sampled, held;
+	unsigned long skipped, ops;
+	uint32_t ncaches;
+	uintptr_t dropped, end;
+	double t;
+	size_t i;
+	char name[32];
+	void *obj;
+
+	if (mode == REPLAY_KMEM)
+		kmem_init();
+
+	ncaches = 0;
+	caches = NULL;
+	map.mask = 1023;
+	map.count = 0;
+	map.objs = calloc(map.mask + 1, sizeof(*map.objs));
+	if (map.objs == NULL)
+		err(1, "calloc");
+	live = peak = sampled = held = 0;
+	skipped = ops = 0;
+	dropped = (uintptr_t)recs & ~(uintptr_t)(getpagesize() - 1);
+
+	gettimeofday(&t_start, NULL);
+	for (i = 0; i < nrecs; i++) {
+		kr = &recs[i];
+		if (kr->kr_cache >= ncaches) {
+			caches = realloc(caches, (kr->kr_cache + 64) * sizeof(*caches));
+			if (caches == NULL)
+				err(1, "realloc");
+			memset(&caches[ncaches], 0,
+			    (kr->kr_cache + 64 - ncaches) * sizeof(*caches));
+			ncaches = kr->kr_cache + 64;
+		}
+		rc = &caches[kr->kr_cache];
+
+		switch (kr->kr_op) {
+		case KMEM_REC_CREATE:
+			if (rc->created)
+				break;
+			rc->created = 1;
+			rc->size = kr->kr_size;
+			if (mode == REPLAY_KMEM && rc->cache == NULL) {
+				snprintf(name, sizeof(name), "replay_%u", kr->kr_cache);
+				rc->cache = kmem_cache_create(strdup(name), kr->kr_size,
+				    kr->kr_obj, NULL, NULL);
+				if (rc->cache == NULL)
+					errx(1, "kmem_cache_create");
+			}
+			break;
+		case KMEM_REC_DESTROY:
+			/* Caches still holding objects the trace missed stay */
+			if (mode == REPLAY_KMEM && rc->cache != NULL &&
+			    rc->live == 0) {
+				kmem_cache_destroy(rc->cache);
+				rc->cache = NULL;
+			}
+			rc->created = 0;
+			break;
+		case KMEM_REC_ALLOC:
+			if (!rc->created) {
+				skipped++;
+				break;
+			}
+			if (mode == REPLAY_KMEM) {
+				kmem_thread_setcpu(kr->kr_thread - 1);
+				obj = kmem_cache_alloc(rc->cache, 0);
+			} else {
+				obj = malloc(rc->size);
+			}
+			if (obj == NULL)
+				errx(1, "replay out of memory");
+			*(char *)obj = 0;
+			replay_insert(&map, kr->kr_obj, obj);
+			rc->live++;
+			live += rc->size;
+			ops++;
+			break;
+		case KMEM_REC_FREE:
+			ro = replay_lookup(&map, kr->kr_obj);
+			if (ro->key == 0 || !rc->created) {
+				/* Allocated before recording started */
+				skipped++;
+				break;
+			}
+			if (mode == REPLAY_KMEM) {
+				kmem_thread_setcpu(kr->kr_thread - 1);
+				kmem_cache_free(rc->cache, ro->obj);
+			} else {
+				free(ro->obj);
+			}
+			replay_remove(&map, ro);
+			rc->live--;
+			live -= rc->size;
+			ops++;
+			break;
+		default:
+			errx(1, "replay: bad record %zu", i);
+		}
+
+		if (live > peak)
+			peak = live;
+		if (i % REPLAY_SAMPLE == 0 && peak > sampled) {
+			sampled = peak;
+			held = replay_footprint(mode, caches, ncaches);
+		}
+
+		/* The replayed part of the trace would count as RSS */
+		if (i % REPLAY_DROP == REPLAY_DROP - 1) {
+			end = (uintptr_t)kr & ~(uintptr_t)(getpagesize() - 1);
+			madvise((void *)dropped, end - dropped, MADV_DONTNEED);
+			dropped = end;
+		}
+	}
+	t = elapsed(&t_start);
+	if (mode == REPLAY_KMEM)
+		kmem_thread_setcpu(-1);
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%-8s %8.3f s %7.1f ns/op\tpeak live %8ju KB\tpeak rss %8ld KB",
+	    mode == REPLAY_KMEM ? "kmem" : "malloc", t,
+	    ops == 0 ? 0.0 : t / ops * 1e9, (uintmax_t)peak / 1024,
+	    ru.ru_maxrss);
+	if (held >= sampled && held != 0)
+		printf("\tfragmentation %5.1f%%",
+		    (held - sampled) * 100.0 / held);
+	printf("\n");
+	if (skipped != 0)
+		printf("\t%lu records skipped, their objects predate the trace\n",
+		    skipped);
+}
+
+void
+do_replay(const char *path)
+{
+	const struct kmem_record_header *hdr;
+	const struct kmem_record *recs;
+	struct stat st;
+	size_t nrecs;
+	pid_t pid;
+	void *map;
+	int fd, mode, status;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(1, "%s", path);
+	if (fstat(fd, &st) < 0)
+		err(1, "%s", path);
+	if ((size_t)st.st_size < sizeof(*hdr))
+		errx(1, "%s: not a trace", path);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		err(1, "mmap");
+	close(fd);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	hdr = map;
+	if (hdr->krh_magic != KMEM_RECORD_MAGIC ||
+	    hdr->krh_version != KMEM_RECORD_VERSION ||
+	    hdr->krh_recsize != sizeof(struct kmem_record))
+		errx(1, "%s: not a version %d trace", path, KMEM_RECORD_VERSION);
+	recs = (const struct kmem_record *)(hdr + 1);
+	nrecs = (st.st_size - sizeof(*hdr)) / sizeof(*recs);
+
+	printf("replaying %s: %zu records\n", path, nrecs);
+
+	for (mode = REPLAY_KMEM; mode <= REPLAY_MALLOC; mode++) {
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0)
+			err(1, "fork");
+		if (pid == 0) {
+			replay_run(mode, recs, nrecs);
+			fflush(stdout);
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0)
+			err(1, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(1, "replay failed");
+	}
+
+	munmap(map, st.st_size);
+}
 
 void
 do_test_free(struct testitem *itm, struct test_set *set)
@@ -289,7 +1443,9 @@ int
 main(int argc, char **argv)
 {
 	int ch;
-	int runmalloc, runplain, runslab;
+	int runmalloc, runplain, runslab, runsize, runfree, runbulk, runtlb, runnuma;
+	int runcolor, runslabbench, runbitmap, dumpformat;
+	const char *replaypath;
 
 	cachecnt = 15;
 	iterations = 10000;
@@ -297,18 +1453,62 @@ main(int argc, char **argv)
 	runmalloc = 1;
 	runplain = 0;
 	runslab = 1;
+	runsize = 1;
+	runfree = 0;
+	runbulk = 0;
+	runtlb = 0;
+	runnuma = 0;
+	runcolor = 0;
+	runslabbench = 0;
+	runbitmap = 0;
+	dumpformat = -1;
+	replaypath = NULL;
 	randseed = 1;
 
-	while ((ch = getopt(argc, argv, "c:Mn:pr:Sv")) != -1) {
+	while ((ch = getopt(argc, argv, "ABbCc:D:FKLMNn:pR:r:STv")) != -1) {
 		switch (ch) {
+		case 'A':
+			kmem_slab_aligned = 0;
+			break;
+		case 'B':
+			runbulk = 1;
+			break;
+		case 'b':
+			runbitmap = 1;
+			break;
+		case 'C':
+			runcolor = 1;
+			break;
 		case 'c':
 			cachecnt = strtol(optarg, &optarg, 10);
 			if (*optarg != '\0')
 				errx(1, "invalid parameter to -c");
 			break;
+		case 'D':
+			if (strcmp(optarg, "text") == 0)
+				dumpformat = KMEM_DUMP_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				dumpformat = KMEM_DUMP_JSON;
+			else
+				errx(1, "invalid parameter to -D");
+			break;
+		case 'F':
+			runfree = 1;
+			break;
+		case 'K':
+			runsize = 0;
+			break;
+		case 'L':
+			runslabbench = 1;
+			break;
 		case 'M':
 			runmalloc = 0;
 			break;
+		case 'N':
+			/* The topology is read once, by the first kmem_init() */
+			setenv("KMEM_NODEMAP", NUMA_NODEMAP, 1);
+			runnuma = 1;
+			break;
 		case 'n':
 			iterations = strtol(optarg, &optarg, 10);
 			if (*optarg != '\0')
@@ -317,6 +1517,9 @@ main(int argc, char **argv)
 		case 'p':
 			runplain = 1;
 			break;
+		case 'R':
+			replaypath = optarg;
+			break;
 		case 'r':
 			randseed = strtol(optarg, &optarg, 10);
 			if (*optarg != '\0')
@@ -325,6 +1528,9 @@ main(int argc, char **argv)
 		case 'S':
 			runslab = 0;
 			break;
+		case 'T':
+			runtlb = 1;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -334,11 +1540,50 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (runslab)
+	if (runslab) {
 		do_test(&kmem_set);
+		do_cdtor_test();
+	}
 
-	if (runmalloc)
+	if (runsize) {
+		do_test(&kmem_alloc_set);
+		do_kmem_alloc_limit_test();
+	}
+
+	if (runmalloc) {
 		do_test(&malloc_set);
+		do_memalign_test();
+#ifndef __SANITIZE_ADDRESS__
+		do_malloc_limit_test();
+#endif
+	}
+
+	if (runfree)
+		do_free_bench();
+
+	if (runbulk)
+		do_bulk_bench();
+
+	if (runtlb)
+		do_tlb_bench();
+
+	if (runnuma)
+		do_numa_test();
+
+	if (runcolor)
+		do_color_bench();
+
+	if (runslabbench)
+		do_slab_bench();
+
+	if (runbitmap)
+		do_bitmap_bench();
+
+	if (replaypath != NULL)
+		do_replay(replaypath);
+
+	if (dumpformat != -1 && kmem_dump(stdout, dumpformat) != 0)
+		err(1, "kmem_dump");
 
 	return 0;
 }
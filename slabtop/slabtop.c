@@ -0,0 +1,291 @@
+/*
+ * This code is derived from software contributed to The DragonFly Project
+ * by Simon Schubert <corecode@fs.ei.tum.de>.
+ *
+ * Copyright (c) 2004 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Show the caches of a program as it runs, ordered by how much their
+ * memory grew since the last look.  The program writes its dumps
+ * through kmem_maint_dump(), or with libkmalloc
+ *
+ *	KMEM_DUMP=/tmp/kmem.dump LD_PRELOAD=libkmalloc.so.1 prog &
+ *	slabtop /tmp/kmem.dump
+ *
+ * slabtop just rereads the file, which is always replaced whole.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc.h"
+
+#define	SLABTOP_NAMELEN	64
+
+struct slabtop_cache {
+	char		sc_name[SLABTOP_NAMELEN];
+	char		sc_layout[8];		/* inline, bitmap or hashed */
+	unsigned long	sc_size;		/* Object size */
+	unsigned long	sc_slabs[3];		/* Used, partial, free slabs */
+	unsigned long	sc_active;		/* Objects allocated from slabs */
+	unsigned long	sc_total;		/* Objects the slabs hold */
+	uintmax_t	sc_mem;			/* Bytes in slabs */
+	uintmax_t	sc_meta;		/* Bookkeeping bytes */
+	uintmax_t	sc_waste;		/* Bytes no object can use */
+	uintmax_t	sc_allocs;		/* Total allocs */
+	intmax_t	sc_growth;		/* sc_mem change since last poll */
+	uintmax_t	sc_newallocs;		/* Allocs since last poll */
+};
+
+struct slabtop_snap {
+	struct slabtop_cache *ss_caches;
+	int		ss_count;
+	int		ss_size;		/* Allocated entries */
+};
+
+static void usage(void);
+static int read_dump(const char *, struct slabtop_snap *);
+static struct slabtop_cache *find_cache(struct slabtop_snap *, const char *);
+static int cache_cmp(const void *, const void *);
+static void show(struct slabtop_snap *, int, int);
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: slabtop [-n count] [-s secs] [-t top] [file]\n");
+	exit(1);
+}
+
+/*
+ * Read a KMEM_DUMP_TEXT dump into snap.  Returns -1 if the file can't
+ * be read, which is normal until the program wrote its first dump.
+ */
+static int
+read_dump(const char *path, struct slabtop_snap *snap)
+{
+	struct slabtop_cache *sc;
+	char line[512];
+	FILE *fp;
+	int version;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	if (fgets(line, sizeof(line), fp) == NULL ||
+	    sscanf(line, "# kmem dump %d", &version) != 1) {
+		fclose(fp);
+		return -1;
+	}
+	if (version != KMEM_DUMP_VERSION)
+		errx(1, "%s: dump version %d, expected %d", path, version,
+		    KMEM_DUMP_VERSION);
+
+	snap->ss_count = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#')
+			continue;
+		if (snap->ss_count == snap->ss_size) {
+			snap->ss_size = snap->ss_size == 0 ? 64 : snap->ss_size * 2;
+			snap->ss_caches = realloc(snap->ss_caches,
+			    snap->ss_size * sizeof(*snap->ss_caches));
+			if (snap->ss_caches == NULL)
+				err(1, "realloc");
+		}
+		sc = &snap->ss_caches[snap->ss_count];
+		memset(sc, 0, sizeof(*sc));
+		/* name size realsize align pages bufs layout slabs... */
+		if (sscanf(line, "%63s %lu %*u %*u %*u %*u %7s %lu %lu %lu %lu %lu"
+		    " %*u %*u %*u %ju %ju %ju %ju", sc->sc_name, &sc->sc_size,
+		    sc->sc_layout, &sc->sc_slabs[0], &sc->sc_slabs[1],
+		    &sc->sc_slabs[2], &sc->sc_active, &sc->sc_total,
+		    &sc->sc_mem, &sc->sc_meta,
+		    &sc->sc_waste, &sc->sc_allocs) != 12)
+			continue;
+		snap->ss_count++;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+static struct slabtop_cache *
+find_cache(struct slabtop_snap *snap, const char *name)
+{
+	int i;
+
+	for (i = 0; i < snap->ss_count; i++)
+		if (strcmp(snap->ss_caches[i].sc_name, name) == 0)
+			return &snap->ss_caches[i];
+	return NULL;
+}
+
+/*
+ * Largest growth first, then largest memory.
+ */
+static int
+cache_cmp(const void *a, const void *b)
+{
+	const struct slabtop_cache *ca = a, *cb = b;
+
+	if (ca->sc_growth != cb->sc_growth)
+		return ca->sc_growth > cb->sc_growth ? -1 : 1;
+	if (ca->sc_mem != cb->sc_mem)
+		return ca->sc_mem > cb->sc_mem ? -1 : 1;
+	return strcmp(ca->sc_name, cb->sc_name);
+}
+
+static void
+show(struct slabtop_snap *snap, int secs, int top)
+{
+	struct slabtop_cache *sc;
+	uintmax_t mem, meta, waste;
+	unsigned long slabs, active, total;
+	int i;
+
+	mem = meta = waste = 0;
+	slabs = active = total = 0;
+	for (i = 0; i < snap->ss_count; i++) {
+		sc = &snap->ss_caches[i];
+		mem += sc->sc_mem;
+		meta += sc->sc_meta;
+		waste += sc->sc_waste;
+		slabs += sc->sc_slabs[0] + sc->sc_slabs[1] + sc->sc_slabs[2];
+		active += sc->sc_active;
+		total += sc->sc_total;
+	}
+
+	if (isatty(STDOUT_FILENO))
+		printf("\033[H\033[J");
+	printf(" Caches: %d  Slabs: %lu  Objects: %lu/%lu (%.1f%%)\n",
+	    snap->ss_count, slabs, active, total,
+	    total == 0 ? 0.0 : active * 100.0 / total);
+	printf(" Memory: %ju KB  Meta: %ju KB  Waste: %ju KB\n\n",
+	    mem / 1024, meta / 1024, waste / 1024);
+	printf("%9s %9s %9s %9s %5s %14s %7s %9s  %s\n", "GROWTH KB",
+	    "MEM KB", "OBJS", "ACTIVE", "USE", "SLABS U/P/F", "LAYOUT",
+	    "ALLOCS/s", "NAME");
+
+	for (i = 0; i < snap->ss_count && (top == 0 || i < top); i++) {
+		char slabbuf[32];
+
+		sc = &snap->ss_caches[i];
+		snprintf(slabbuf, sizeof(slabbuf), "%lu/%lu/%lu",
+		    sc->sc_slabs[0], sc->sc_slabs[1], sc->sc_slabs[2]);
+		printf("%+9jd %9ju %9lu %9lu %4lu%% %14s %7s %9ju  %s\n",
+		    sc->sc_growth / 1024, sc->sc_mem / 1024,
+		    sc->sc_total, sc->sc_active,
+		    sc->sc_total == 0 ? 0 : sc->sc_active * 100 / sc->sc_total,
+		    slabbuf, sc->sc_layout,
+		    sc->sc_newallocs / secs, sc->sc_name);
+	}
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct slabtop_snap snaps[2], *cur, *prev;
+	struct slabtop_cache *sc, *old;
+	const char *path;
+	int ch, count, secs, top, i, n;
+
+	count = 0;
+	secs = 1;
+	top = 20;
+	while ((ch = getopt(argc, argv, "n:s:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = strtol(optarg, &optarg, 10);
+			if (*optarg != '\0' || count < 0)
+				errx(1, "invalid parameter to -n");
+			break;
+		case 's':
+			secs = strtol(optarg, &optarg, 10);
+			if (*optarg != '\0' || secs <= 0)
+				errx(1, "invalid parameter to -s");
+			break;
+		case 't':
+			top = strtol(optarg, &optarg, 10);
+			if (*optarg != '\0' || top < 0)
+				errx(1, "invalid parameter to -t");
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1)
+		usage();
+	path = argc == 1 ? argv[0] : getenv("KMEM_DUMP");
+	if (path == NULL)
+		usage();
+
+	memset(snaps, 0, sizeof(snaps));
+	cur = &snaps[0];
+	prev = NULL;
+	for (n = 0; count == 0 || n < count; n++) {
+		if (n != 0)
+			sleep(secs);
+		if (read_dump(path, cur) != 0) {
+			if (n == 0 && count == 1)
+				err(1, "%s", path);
+			continue;
+		}
+
+		/* Caches that weren't there before grew from nothing */
+		for (i = 0; i < cur->ss_count; i++) {
+			sc = &cur->ss_caches[i];
+			old = prev == NULL ? NULL : find_cache(prev, sc->sc_name);
+			if (old != NULL) {
+				sc->sc_growth = (intmax_t)(sc->sc_mem - old->sc_mem);
+				sc->sc_newallocs = sc->sc_allocs - old->sc_allocs;
+			} else if (prev != NULL) {
+				sc->sc_growth = sc->sc_mem;
+				sc->sc_newallocs = sc->sc_allocs;
+			}
+		}
+		qsort(cur->ss_caches, cur->ss_count, sizeof(*cur->ss_caches),
+		    cache_cmp);
+		show(cur, secs, top);
+
+		prev = cur;
+		cur = cur == &snaps[0] ? &snaps[1] : &snaps[0];
+	}
+
+	return 0;
+}
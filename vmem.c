@@ -0,0 +1,899 @@
+/*
+ * This code is derived from software contributed to The DragonFly Project
+ * by Simon Schubert <corecode@fs.ei.tum.de>.
+ *
+ * Copyright (c) 2004 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Page arena.  Address space is reserved in large, aligned regions,
+ * and handed out in spans of pages.  Each region keeps a boundary tag
+ * for the first and last page of every span, so freed spans are
+ * coalesced with their neighbors in constant time.  Free spans are
+ * kept on segregated lists: one per size up to VM_NEXACT pages, then
+ * one per power of two.  A bitmap of non-empty lists finds the first
+ * list that is sure to fit.  Single pages and aligned page pairs,
+ * which make up most slabs, are cached in small stacks in front of
+ * the arena.
+ *
+ * Free spans of VM_RELEASE_PAGES or more are given back to the
+ * kernel, keeping the address space.  vmem_reap() gives back all of
+ * them.
+ *
+ * Arenas created with VMC_HUGEPAGE back their regions with huge pages,
+ * from the hugetlb pool if it has enough, otherwise by asking for
+ * transparent huge pages.  They only give back whole huge pages.
+ *
+ * An arena can be tied to a NUMA node, and then prefers that node's
+ * memory for all of its regions.  vmem_node() tells the node of any
+ * address handed out.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#ifndef _KERNEL
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define	PAGESIZ		4096
+
+#ifndef MAP_ANON
+#define	MAP_ANON	MAP_ANONYMOUS
+#endif
+#ifndef MAP_NORESERVE
+#define	MAP_NORESERVE	0
+#endif
+
+#define	HUGEPAGESIZ	(2 * 1024 * 1024)
+
+static __inline void *
+vmem_map(size_t size)
+{
+	void *addr;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	return (addr == MAP_FAILED ? NULL : addr);
+}
+
+/*
+ * Back the reserved range at addr with huge pages.  Returns 1 if they
+ * come from the hugetlb pool, 0 if only transparent huge pages were
+ * requested.
+ */
+static __inline int
+vmem_map_huge(void *addr, size_t size)
+{
+#ifdef MAP_HUGETLB
+	if (mmap(addr, size, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED)
+		return 1;
+
+	/* A failed MAP_FIXED can leave the range in any state */
+	if (mmap(addr, size, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+		err(1, "vmem_map_huge");
+#endif
+#ifdef MADV_HUGEPAGE
+	madvise(addr, size, MADV_HUGEPAGE);
+#endif
+	return 0;
+}
+
+/*
+ * Prefer the memory of node for the range at addr.  This is only a
+ * preference, so running out of memory on one node doesn't fail.
+ * Returns 0 on success.
+ */
+static __inline int
+vmem_bind(void *addr, size_t size, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	unsigned long mask[4];
+
+	if (node < 0 || node >= (int)(sizeof(mask) * NBBY))
+		return -1;
+	mask[0] = mask[1] = mask[2] = mask[3] = 0;
+	mask[node / (sizeof(mask[0]) * NBBY)] |=
+	    1UL << (node % (sizeof(mask[0]) * NBBY));
+	return syscall(SYS_mbind, addr, size, 1 /* MPOL_PREFERRED */,
+	    mask, sizeof(mask) * NBBY, 0);
+#else
+	return -1;
+#endif
+}
+
+#define	vmem_unmap(addr, size)		munmap((addr), (size))
+#define	vmem_release(addr, size)	madvise((addr), (size), MADV_DONTNEED)
+
+typedef pthread_mutex_t	vmem_lock_t;
+
+#define	vmem_lock_init(lock)	pthread_mutex_init((lock), NULL)
+#define	vmem_lock(lock)		pthread_mutex_lock(lock)
+#define	vmem_unlock(lock)	pthread_mutex_unlock(lock)
+
+#define	KKASSERT(cond) do {			\
+	if (!(cond)) {				\
+		fprintf(stderr, "panic: assertion `%s' failed", #cond); \
+		abort();			\
+	}					\
+} while (0)
+
+#endif
+
+
+#include "vmem.h"
+
+#define	VM_REGIONSHIFT	26		/* 64MB regions */
+#define	VM_REGIONSIZE	(1UL << VM_REGIONSHIFT)
+#define	VM_REGIONPAGES	(VM_REGIONSIZE / PAGESIZ)
+#define	VM_MAPSHIFT	11		/* Bits per region map level */
+#define	VM_MAPSIZE	(1UL << VM_MAPSHIFT)
+
+#define	VM_NEXACT	32		/* Free lists for exact sizes */
+#define	VM_NFREELISTS	64		/* One bit each in vm_freemap */
+#define	VM_SEARCH_MAX	16		/* Spans checked on lists w/o sure fit */
+
+#define	VM_QCACHE_MAX	2		/* Largest span quantum cached */
+#define	VM_QCACHE_DEPTH	64		/* Spans per quantum cache */
+
+#define	VM_RELEASE_PAGES 64		/* Free spans given back to the kernel */
+
+/*
+ * Boundary tag.  Only the first and last page of a span carry valid
+ * information, and only the first page of a free span is linked.
+ */
+struct vmem_page {
+	LIST_ENTRY(vmem_page) vp_entry;		/* Free list linkage */
+	struct vmem_region *vp_region;		/* Region of this page */
+	unsigned int	vp_npages;		/* Pages in span */
+	unsigned int	vp_flags;		/* VPF_* flags */
+	void		*vp_owner;		/* Set by vmem_setowner() */
+};
+
+#define	VPF_FREE	0x0001		/* Span is free */
+#define	VPF_DIRTY	0x0002		/* Free span might be resident */
+
+struct vmem_region {
+	TAILQ_ENTRY(vmem_region) vr_entry;	/* Regions of the arena */
+	struct vmem	*vr_arena;		/* Arena of this region */
+	char		*vr_base;		/* First page */
+	size_t		vr_npages;		/* Pages in region */
+	struct vmem_page vr_pages[];		/* Boundary tags */
+};
+
+struct vmem_qcache {
+	unsigned int	vq_count;		/* Spans in cache */
+	void		*vq_span[VM_QCACHE_DEPTH];	/* Stack of spans */
+};
+
+struct vmem {
+	vmem_lock_t	vm_lock;		/* Protects the arena */
+	LIST_ENTRY(vmem) vm_entry;		/* All arenas */
+	const char	*vm_name;		/* Informational name */
+	int		vm_flags;		/* VMC_* flags */
+	int		vm_node;		/* NUMA node, -1 for any */
+	size_t		vm_quantum;		/* Pages given back at once */
+	size_t		vm_releasepages;	/* Smallest span given back */
+	unsigned long	vm_freemap;		/* Non-empty free lists */
+	LIST_HEAD(, vmem_page) vm_freelist[VM_NFREELISTS];	/* Free spans */
+	TAILQ_HEAD(, vmem_region) vm_regions;	/* All regions */
+	struct vmem_qcache vm_qcache[VM_QCACHE_MAX];	/* 1 and 2 page spans */
+	struct vmem_stats vm_stats;		/* Statistics */
+};
+
+
+static struct vmem_region *vmem_region_lookup(void *);
+static struct vmem_region *vmem_region_create(struct vmem *, size_t, size_t);
+static int vmem_freelist_class(size_t);
+static void vmem_span_tag(struct vmem_region *, size_t, size_t, unsigned int);
+static void vmem_span_insert(struct vmem *, struct vmem_region *, size_t,
+		size_t, unsigned int);
+static void vmem_span_remove(struct vmem *, struct vmem_page *);
+static struct vmem_page *vmem_span_find(struct vmem *, size_t, size_t,
+		size_t *);
+static void vmem_span_free(struct vmem *, struct vmem_region *, size_t,
+		size_t);
+static int vmem_span_release(struct vmem *, struct vmem_region *, size_t,
+		size_t);
+
+
+/*
+ * Regions by address, over two levels.  Entries are only ever added,
+ * so lookups need no lock.
+ */
+static vmem_lock_t vmem_maplock = PTHREAD_MUTEX_INITIALIZER;
+static struct vmem_region **vmem_regionmap[VM_MAPSIZE];
+
+/* Arenas are never destroyed, the list is only needed around fork() */
+static vmem_lock_t vmem_arenalock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, vmem) vmem_arenas = LIST_HEAD_INITIALIZER(vmem_arenas);
+
+static struct vmem_region *
+vmem_region_lookup(void *addr)
+{
+	struct vmem_region **leaf;
+	unsigned long idx;
+
+	idx = (unsigned long)addr >> VM_REGIONSHIFT;
+	if ((idx >> VM_MAPSHIFT) >= VM_MAPSIZE)
+		return NULL;
+	leaf = vmem_regionmap[idx >> VM_MAPSHIFT];
+	if (leaf == NULL)
+		return NULL;
+
+	return leaf[idx & (VM_MAPSIZE - 1)];
+}
+
+struct vmem *
+vmem_create(const char *name, int flags, int node)
+{
+	struct vmem *vm;
+	int i;
+
+	vm = vmem_map(roundup(sizeof(*vm), PAGESIZ));
+	if (vm == NULL)
+		return NULL;
+
+	vmem_lock_init(&vm->vm_lock);
+	vm->vm_name = name;
+	vm->vm_flags = flags;
+	vm->vm_node = node;
+	vm->vm_quantum = 1;
+	if (flags & VMC_HUGEPAGE)
+		vm->vm_quantum = HUGEPAGESIZ / PAGESIZ;
+	vm->vm_releasepages = MAX(VM_RELEASE_PAGES, vm->vm_quantum);
+	vm->vm_freemap = 0;
+	for (i = 0; i < VM_NFREELISTS; i++)
+		LIST_INIT(&vm->vm_freelist[i]);
+	TAILQ_INIT(&vm->vm_regions);
+	for (i = 0; i < VM_QCACHE_MAX; i++)
+		vm->vm_qcache[i].vq_count = 0;
+	vm->vm_stats.vms_reserved = 0;
+	vm->vm_stats.vms_inuse = 0;
+	vm->vm_stats.vms_qcached = 0;
+	vm->vm_stats.vms_released = 0;
+	vm->vm_stats.vms_regions = 0;
+	vm->vm_stats.vms_hugetlb = 0;
+	vm->vm_stats.vms_bound = 0;
+
+	vmem_lock(&vmem_arenalock);
+	LIST_INSERT_HEAD(&vmem_arenas, vm, vm_entry);
+	vmem_unlock(&vmem_arenalock);
+
+	return vm;
+}
+
+/*
+ * Take all vmem locks before a fork(), and release them after it in
+ * the parent, or set them up again in the child.  The region map is
+ * only locked from within an arena, so it comes last.
+ */
+void
+vmem_fork_prepare(void)
+{
+	struct vmem *vm;
+
+	vmem_lock(&vmem_arenalock);
+	LIST_FOREACH(vm, &vmem_arenas, vm_entry)
+		vmem_lock(&vm->vm_lock);
+	vmem_lock(&vmem_maplock);
+}
+
+void
+vmem_fork_parent(void)
+{
+	struct vmem *vm;
+
+	vmem_unlock(&vmem_maplock);
+	LIST_FOREACH(vm, &vmem_arenas, vm_entry)
+		vmem_unlock(&vm->vm_lock);
+	vmem_unlock(&vmem_arenalock);
+}
+
+void
+vmem_fork_child(void)
+{
+	struct vmem *vm;
+
+	vmem_lock_init(&vmem_maplock);
+	LIST_FOREACH(vm, &vmem_arenas, vm_entry)
+		vmem_lock_init(&vm->vm_lock);
+	vmem_lock_init(&vmem_arenalock);
+}
+
+/*
+ * Reserve a region of at least npages pages, aligned to the region
+ * size or to align pages if that is larger, and add it to the arena
+ * as a single free span.  Called with the arena lock held.
+ */
+static struct vmem_region *
+vmem_region_create(struct vmem *vm, size_t npages, size_t align)
+{
+	struct vmem_region *vr;
+	size_t size, lead, tail;
+	unsigned long idx, end;
+	char *addr;
+
+	/* Spans have to fit the boundary tags */
+	if (npages > UINT_MAX - VM_REGIONPAGES)
+		return NULL;
+
+	size = roundup(npages * PAGESIZ, VM_REGIONSIZE);
+	align = MAX(align * PAGESIZ, VM_REGIONSIZE);
+
+	addr = vmem_map(size + align - PAGESIZ);
+	if (addr == NULL)
+		return NULL;
+	lead = -(unsigned long)addr & (align - 1);
+	tail = align - PAGESIZ - lead;
+	if (lead != 0)
+		vmem_unmap(addr, lead);
+	if (tail != 0)
+		vmem_unmap(addr + lead + size, tail);
+	addr += lead;
+
+	if ((vm->vm_flags & VMC_HUGEPAGE) && vmem_map_huge(addr, size))
+		vm->vm_stats.vms_hugetlb++;
+	if (vm->vm_node >= 0 && vmem_bind(addr, size, vm->vm_node) == 0)
+		vm->vm_stats.vms_bound++;
+
+	vr = vmem_map(roundup(sizeof(*vr) +
+	    size / PAGESIZ * sizeof(struct vmem_page), PAGESIZ));
+	if (vr == NULL) {
+		vmem_unmap(addr, size);
+		return NULL;
+	}
+	vr->vr_arena = vm;
+	vr->vr_base = addr;
+	vr->vr_npages = size / PAGESIZ;
+
+	/* Enter the region into the map */
+	vmem_lock(&vmem_maplock);
+	idx = (unsigned long)addr >> VM_REGIONSHIFT;
+	end = idx + (size >> VM_REGIONSHIFT);
+	KKASSERT((end - 1) >> VM_MAPSHIFT < VM_MAPSIZE);
+	for (; idx < end; idx++) {
+		struct vmem_region **leaf;
+
+		leaf = vmem_regionmap[idx >> VM_MAPSHIFT];
+		if (leaf == NULL) {
+			leaf = vmem_map(VM_MAPSIZE * sizeof(*leaf));
+			if (leaf == NULL)
+				err(1, "vmem_region_create");
+			vmem_regionmap[idx >> VM_MAPSHIFT] = leaf;
+		}
+		leaf[idx & (VM_MAPSIZE - 1)] = vr;
+	}
+	vmem_unlock(&vmem_maplock);
+
+	TAILQ_INSERT_TAIL(&vm->vm_regions, vr, vr_entry);
+	vm->vm_stats.vms_reserved += vr->vr_npages;
+	vm->vm_stats.vms_regions++;
+
+	/* Fresh address space isn't resident */
+	vmem_span_insert(vm, vr, 0, vr->vr_npages, 0);
+
+	return vr;
+}
+
+/*
+ * Exact lists for small spans, then one list per power of two.
+ */
+static __inline int
+vmem_freelist_class(size_t npages)
+{
+	int class;
+
+	if (npages <= VM_NEXACT)
+		return npages - 1;
+
+	class = VM_NEXACT + (63 - __builtin_clzl(npages)) - 5;
+	return MIN(class, VM_NFREELISTS - 1);
+}
+
+static __inline char *
+vmem_page_addr(struct vmem_region *vr, size_t idx)
+{
+	return vr->vr_base + idx * PAGESIZ;
+}
+
+/*
+ * Round page idx up so that its address is aligned to align pages.
+ * Regions are only aligned to their own size, so larger alignments
+ * have to look at the address.
+ */
+static __inline size_t
+vmem_page_align(struct vmem_region *vr, size_t idx, size_t align)
+{
+	unsigned long base;
+
+	base = (unsigned long)vr->vr_base / PAGESIZ;
+	return roundup(base + idx, align) - base;
+}
+
+/*
+ * Set the boundary tags of the span at page idx.
+ */
+static void
+vmem_span_tag(struct vmem_region *vr, size_t idx, size_t npages,
+		unsigned int flags)
+{
+	struct vmem_page *first, *last;
+
+	first = &vr->vr_pages[idx];
+	last = &vr->vr_pages[idx + npages - 1];
+	first->vp_region = last->vp_region = vr;
+	first->vp_npages = last->vp_npages = npages;
+	first->vp_flags = last->vp_flags = flags;
+}
+
+static void
+vmem_span_insert(struct vmem *vm, struct vmem_region *vr, size_t idx,
+		size_t npages, unsigned int dirty)
+{
+	int class;
+
+	vmem_span_tag(vr, idx, npages, VPF_FREE | dirty);
+	class = vmem_freelist_class(npages);
+	LIST_INSERT_HEAD(&vm->vm_freelist[class], &vr->vr_pages[idx], vp_entry);
+	vm->vm_freemap |= 1UL << class;
+}
+
+static void
+vmem_span_remove(struct vmem *vm, struct vmem_page *vp)
+{
+	int class;
+
+	class = vmem_freelist_class(vp->vp_npages);
+	LIST_REMOVE(vp, vp_entry);
+	if (LIST_EMPTY(&vm->vm_freelist[class]))
+		vm->vm_freemap &= ~(1UL << class);
+}
+
+/*
+ * Find a free span that holds npages pages aligned to align pages.
+ * Returns its first page, and the page index of the aligned range in
+ * *idxp.
+ */
+static struct vmem_page *
+vmem_span_find(struct vmem *vm, size_t npages, size_t align, size_t *idxp)
+{
+	struct vmem_page *vp;
+	unsigned long map;
+	size_t idx, start;
+	int class, n;
+
+	class = vmem_freelist_class(npages);
+
+	/*
+	 * Exact lists fit right away if there is no alignment, other
+	 * lists need to be searched.
+	 */
+	n = 0;
+	LIST_FOREACH(vp, &vm->vm_freelist[class], vp_entry) {
+		idx = vp - vp->vp_region->vr_pages;
+		start = vmem_page_align(vp->vp_region, idx, align);
+		if (start + npages <= idx + vp->vp_npages) {
+			*idxp = start;
+			return vp;
+		}
+		if (++n == VM_SEARCH_MAX)
+			break;
+	}
+
+	/*
+	 * Any span on a larger list is large enough, but with
+	 * alignment it might still not fit.
+	 */
+	if (class + 1 >= VM_NFREELISTS)
+		return NULL;
+	map = vm->vm_freemap & ~((2UL << class) - 1);
+	while (map != 0) {
+		class = __builtin_ctzl(map);
+		map &= map - 1;
+
+		n = 0;
+		LIST_FOREACH(vp, &vm->vm_freelist[class], vp_entry) {
+			idx = vp - vp->vp_region->vr_pages;
+			start = vmem_page_align(vp->vp_region, idx, align);
+			if (start + npages <= idx + vp->vp_npages) {
+				*idxp = start;
+				return vp;
+			}
+			if (++n == VM_SEARCH_MAX)
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Allocate npages pages.  With VM_ALIGNED, npages must be a power of
+ * two and the span is aligned to its size.
+ */
+void *
+vmem_alloc(struct vmem *vm, size_t npages, int flags)
+{
+	struct vmem_region *vr;
+	struct vmem_page *vp;
+	struct vmem_qcache *vq;
+	size_t align, idx, span, lead, tail;
+	unsigned int dirty;
+	void *addr;
+
+	KKASSERT(npages > 0);
+	align = 1;
+	if (flags & VM_ALIGNED) {
+		KKASSERT((npages & (npages - 1)) == 0);
+		align = npages;
+	}
+
+	vmem_lock(&vm->vm_lock);
+
+	/* Quantum caches only hold naturally aligned spans */
+	if (npages <= VM_QCACHE_MAX) {
+		vq = &vm->vm_qcache[npages - 1];
+		if (vq->vq_count > 0) {
+			addr = vq->vq_span[--vq->vq_count];
+			vm->vm_stats.vms_qcached -= npages;
+			vm->vm_stats.vms_inuse += npages;
+			vmem_unlock(&vm->vm_lock);
+			return addr;
+		}
+	}
+
+	vp = vmem_span_find(vm, npages, align, &idx);
+	if (vp == NULL) {
+		vr = vmem_region_create(vm, npages, align);
+		if (vr == NULL) {
+			vmem_unlock(&vm->vm_lock);
+			return NULL;
+		}
+		vp = vmem_span_find(vm, npages, align, &idx);
+		KKASSERT(vp != NULL);
+	}
+
+	/* Carve the range out of the span and put back what's left */
+	vr = vp->vp_region;
+	span = vp - vr->vr_pages;
+	lead = idx - span;
+	tail = vp->vp_npages - lead - npages;
+	dirty = vp->vp_flags & VPF_DIRTY;
+	vmem_span_remove(vm, vp);
+	if (lead != 0)
+		vmem_span_insert(vm, vr, span, lead, dirty);
+	if (tail != 0)
+		vmem_span_insert(vm, vr, idx + npages, tail, dirty);
+	vmem_span_tag(vr, idx, npages, 0);
+
+	vm->vm_stats.vms_inuse += npages;
+	vmem_unlock(&vm->vm_lock);
+
+	return vmem_page_addr(vr, idx);
+}
+
+/*
+ * Return the span of npages pages at addr to the free lists,
+ * coalescing it with free neighbors.  If the result is large, give
+ * the parts that might be resident back to the kernel.  Called with
+ * the arena lock held.
+ */
+static void
+vmem_span_free(struct vmem *vm, struct vmem_region *vr, size_t idx,
+		size_t npages)
+{
+	struct vmem_page *vp;
+	size_t start, total, lidx, lnpages, ridx, rnpages;
+	unsigned int ldirty, rdirty;
+
+	start = idx;
+	total = npages;
+	lnpages = rnpages = 0;
+	ldirty = rdirty = 0;
+
+	if (idx > 0 && (vr->vr_pages[idx - 1].vp_flags & VPF_FREE)) {
+		lnpages = vr->vr_pages[idx - 1].vp_npages;
+		lidx = idx - lnpages;
+		vp = &vr->vr_pages[lidx];
+		ldirty = vp->vp_flags & VPF_DIRTY;
+		vmem_span_remove(vm, vp);
+		start = lidx;
+		total += lnpages;
+	}
+
+	ridx = idx + npages;
+	if (ridx < vr->vr_npages && (vr->vr_pages[ridx].vp_flags & VPF_FREE)) {
+		vp = &vr->vr_pages[ridx];
+		rnpages = vp->vp_npages;
+		rdirty = vp->vp_flags & VPF_DIRTY;
+		vmem_span_remove(vm, vp);
+		total += rnpages;
+	}
+
+	if (total < vm->vm_releasepages) {
+		vmem_span_insert(vm, vr, start, total, VPF_DIRTY);
+		return;
+	}
+
+	if (vm->vm_quantum > 1) {
+		vmem_span_insert(vm, vr, start, total,
+		    vmem_span_release(vm, vr, start, total));
+		return;
+	}
+
+	vmem_release(vmem_page_addr(vr, idx), npages * PAGESIZ);
+	vm->vm_stats.vms_released += npages;
+	if (ldirty) {
+		vmem_release(vmem_page_addr(vr, lidx), lnpages * PAGESIZ);
+		vm->vm_stats.vms_released += lnpages;
+	}
+	if (rdirty) {
+		vmem_release(vmem_page_addr(vr, ridx), rnpages * PAGESIZ);
+		vm->vm_stats.vms_released += rnpages;
+	}
+	vmem_span_insert(vm, vr, start, total, 0);
+}
+
+/*
+ * Give back the whole huge pages within a free span.  Returns
+ * VPF_DIRTY if parts of it might still be resident.
+ */
+static int
+vmem_span_release(struct vmem *vm, struct vmem_region *vr, size_t idx,
+		size_t npages)
+{
+	size_t start, end;
+
+	start = roundup(idx, vm->vm_quantum);
+	end = (idx + npages) / vm->vm_quantum * vm->vm_quantum;
+	if (start < end) {
+		vmem_release(vmem_page_addr(vr, start), (end - start) * PAGESIZ);
+		vm->vm_stats.vms_released += end - start;
+	}
+
+	return (start == idx && end == idx + npages ? 0 : VPF_DIRTY);
+}
+
+void
+vmem_free(struct vmem *vm, void *addr, size_t npages)
+{
+	struct vmem_region *vr;
+	struct vmem_qcache *vq;
+	size_t idx;
+
+	vr = vmem_region_lookup(addr);
+	KKASSERT(vr != NULL);
+	idx = ((char *)addr - vr->vr_base) / PAGESIZ;
+	KKASSERT(vr->vr_pages[idx].vp_npages == npages &&
+	    !(vr->vr_pages[idx].vp_flags & VPF_FREE));
+
+	vmem_lock(&vm->vm_lock);
+	vm->vm_stats.vms_inuse -= npages;
+
+	if (npages <= VM_QCACHE_MAX && (idx & (npages - 1)) == 0) {
+		vq = &vm->vm_qcache[npages - 1];
+		if (vq->vq_count < VM_QCACHE_DEPTH) {
+			vq->vq_span[vq->vq_count++] = addr;
+			vm->vm_stats.vms_qcached += npages;
+			vmem_unlock(&vm->vm_lock);
+			return;
+		}
+	}
+
+	vmem_span_free(vm, vr, idx, npages);
+	vmem_unlock(&vm->vm_lock);
+}
+
+/*
+ * Empty the quantum caches and give all free pages back to the
+ * kernel.  Returns the number of pages given back.
+ */
+size_t
+vmem_reap(struct vmem *vm)
+{
+	struct vmem_region *vr;
+	struct vmem_qcache *vq;
+	struct vmem_page *vp;
+	size_t released, npages, idx;
+	int i;
+
+	vmem_lock(&vm->vm_lock);
+	released = vm->vm_stats.vms_released;
+
+	for (i = 0; i < VM_QCACHE_MAX; i++) {
+		vq = &vm->vm_qcache[i];
+		npages = i + 1;
+		while (vq->vq_count > 0) {
+			void *addr;
+
+			addr = vq->vq_span[--vq->vq_count];
+			vm->vm_stats.vms_qcached -= npages;
+			vr = vmem_region_lookup(addr);
+			vmem_span_free(vm, vr, ((char *)addr - vr->vr_base) / PAGESIZ,
+			    npages);
+		}
+	}
+
+	for (i = 0; i < VM_NFREELISTS; i++) {
+		LIST_FOREACH(vp, &vm->vm_freelist[i], vp_entry) {
+			if (!(vp->vp_flags & VPF_DIRTY))
+				continue;
+
+			vr = vp->vp_region;
+			idx = vp - vr->vr_pages;
+			if (vm->vm_quantum > 1) {
+				vmem_span_tag(vr, idx, vp->vp_npages, VPF_FREE |
+				    vmem_span_release(vm, vr, idx, vp->vp_npages));
+				continue;
+			}
+			vmem_release(vmem_page_addr(vr, idx), vp->vp_npages * PAGESIZ);
+			vm->vm_stats.vms_released += vp->vp_npages;
+			vmem_span_tag(vr, idx, vp->vp_npages, VPF_FREE);
+		}
+	}
+
+	released = vm->vm_stats.vms_released - released;
+	vmem_unlock(&vm->vm_lock);
+
+	return released;
+}
+
+/*
+ * Return the NUMA node of the arena addr was allocated from, or -1.
+ * This takes no locks.
+ */
+int
+vmem_node(void *addr)
+{
+	struct vmem_region *vr;
+
+	vr = vmem_region_lookup(addr);
+	if (vr == NULL)
+		return -1;
+
+	return vr->vr_arena->vm_node;
+}
+
+/*
+ * Return the arena addr was allocated from, or NULL if it isn't
+ * part of any.  This takes no locks.
+ */
+struct vmem *
+vmem_arena(void *addr)
+{
+	struct vmem_region *vr;
+
+	vr = vmem_region_lookup(addr);
+	if (vr == NULL)
+		return NULL;
+
+	return vr->vr_arena;
+}
+
+/*
+ * Return the number of pages of the allocated span starting at addr.
+ * Only the owner of the span can ask.
+ */
+size_t
+vmem_size(void *addr)
+{
+	struct vmem_region *vr;
+
+	vr = vmem_region_lookup(addr);
+	KKASSERT(vr != NULL);
+
+	return vr->vr_pages[((char *)addr - vr->vr_base) / PAGESIZ].vp_npages;
+}
+
+/*
+ * Attach an opaque owner to every page of an allocated span, so that
+ * vmem_owner() can map addresses inside it back to their user.  The
+ * owner stays set until it is set again, even after the span is freed.
+ */
+void
+vmem_setowner(void *addr, size_t npages, void *owner)
+{
+	struct vmem_region *vr;
+	size_t idx, i;
+
+	vr = vmem_region_lookup(addr);
+	KKASSERT(vr != NULL);
+	idx = ((char *)addr - vr->vr_base) / PAGESIZ;
+	for (i = 0; i < npages; i++)
+		vr->vr_pages[idx + i].vp_owner = owner;
+}
+
+/*
+ * Return the owner of the page addr is in, or NULL if there is none.
+ * This takes no locks.
+ */
+void *
+vmem_owner(void *addr)
+{
+	struct vmem_region *vr;
+
+	vr = vmem_region_lookup(addr);
+	if (vr == NULL)
+		return NULL;
+
+	return vr->vr_pages[((char *)addr - vr->vr_base) / PAGESIZ].vp_owner;
+}
+
+void
+vmem_getstats(struct vmem *vm, struct vmem_stats *stats)
+{
+	vmem_lock(&vm->vm_lock);
+	*stats = vm->vm_stats;
+	vmem_unlock(&vm->vm_lock);
+}
+
+void
+vmem_debug(struct vmem *vm)
+{
+	struct vmem_page *vp;
+	unsigned long spans, pages;
+	int i;
+
+	vmem_lock(&vm->vm_lock);
+	printf("vmem arena statistics for: %s\n", vm->vm_name);
+	printf("regions: %u\treserved: %lu pages\tin use: %lu pages\n",
+	    vm->vm_stats.vms_regions, vm->vm_stats.vms_reserved,
+	    vm->vm_stats.vms_inuse);
+	printf("quantum cached: %lu pages\treleased: %lu pages\n",
+	    vm->vm_stats.vms_qcached, vm->vm_stats.vms_released);
+	if (vm->vm_flags & VMC_HUGEPAGE)
+		printf("huge pages: %u regions hugetlb, %u transparent\n",
+		    vm->vm_stats.vms_hugetlb,
+		    vm->vm_stats.vms_regions - vm->vm_stats.vms_hugetlb);
+	if (vm->vm_node >= 0)
+		printf("node: %d\tbound regions: %u\n", vm->vm_node,
+		    vm->vm_stats.vms_bound);
+
+	spans = pages = 0;
+	for (i = 0; i < VM_NFREELISTS; i++) {
+		LIST_FOREACH(vp, &vm->vm_freelist[i], vp_entry) {
+			spans++;
+			pages += vp->vp_npages;
+		}
+	}
+	printf("free: %lu spans\t%lu pages\n", spans, pages);
+	vmem_unlock(&vm->vm_lock);
+}
@@ -0,0 +1,71 @@
+/*
+ * This code is derived from software contributed to The DragonFly Project
+ * by Simon Schubert <corecode@fs.ei.tum.de>.
+ *
+ * Copyright (c) 2004 The DragonFly Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef VMEM_H
+#define	VMEM_H
+
+/* vmem_create() flags */
+#define	VMC_HUGEPAGE	0x0001		/* Back regions with huge pages */
+
+/* vmem_alloc() flags */
+#define	VM_ALIGNED	0x0001		/* Naturally aligned, power of 2 pages */
+
+struct vmem_stats {
+	unsigned long	vms_reserved;		/* Pages of address space */
+	unsigned long	vms_inuse;		/* Pages handed out */
+	unsigned long	vms_qcached;		/* Pages in quantum caches */
+	unsigned long	vms_released;		/* Pages given back, total */
+	unsigned int	vms_regions;		/* Regions reserved */
+	unsigned int	vms_hugetlb;		/* Regions from the hugetlb pool */
+	unsigned int	vms_bound;		/* Regions bound to vm_node */
+};
+
+struct vmem;
+
+struct vmem *vmem_create(const char *, int, int);
+void *vmem_alloc(struct vmem *, size_t, int);
+void vmem_free(struct vmem *, void *, size_t);
+size_t vmem_reap(struct vmem *);
+int vmem_node(void *);
+struct vmem *vmem_arena(void *);
+size_t vmem_size(void *);
+void vmem_setowner(void *, size_t, void *);
+void *vmem_owner(void *);
+void vmem_getstats(struct vmem *, struct vmem_stats *);
+void vmem_debug(struct vmem *);
+void vmem_fork_prepare(void);
+void vmem_fork_parent(void);
+void vmem_fork_child(void);
+
+#endif